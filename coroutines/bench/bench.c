@@ -0,0 +1,284 @@
+// micro-benchmarks of the scheduler
+// build: cc -O2 bench.c ../coroutines.c ../cochan.c -o bench
+// kept in its own directory so that `$(CC) *.c` of the library still has one main
+// usage: ./bench [-p] [-n samples]
+//   -p  count cpu cycles with perf_event_open instead of the timestamp counter
+// every result is printed as one json object per line; cycle figures are per operation
+
+#define _GNU_SOURCE
+#include <err.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "../coroutines.h"
+#include "../cochan.h"
+
+// operations timed together in one sample, to amortize reading the counter
+#define BATCH 16
+
+static int perf_fd = -1;
+static size_t nsamples = 20000;
+
+static int perf_open(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CPU_CYCLES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd != -1)
+        ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    return fd;
+}
+
+static const char *counter_name(void) {
+    if (perf_fd != -1)
+        return "perf_cycles";
+#if defined(__x86_64__)
+    return "rdtsc";
+#elif defined(__aarch64__)
+    return "cntvct";
+#else
+    return "ns";
+#endif
+}
+
+static inline uint64_t cycles(void) {
+    if (perf_fd != -1) {
+        uint64_t v = 0;
+        if (read(perf_fd, &v, sizeof v) != sizeof v)
+            err(1, "cannot read perf counter");
+        return v;
+    }
+#if defined(__x86_64__)
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ volatile("isb; mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// prints percentiles of samples, each the count of `per` operations
+static void report(const char *bench, const char *params, uint64_t *samples, size_t n, size_t per) {
+    qsort(samples, n, sizeof *samples, cmp_u64);
+#define PCT(P) ((double)samples[(size_t)((n - 1) * (P))] / per)
+    printf("{\"bench\":\"%s\",%s,\"counter\":\"%s\",\"samples\":%zu,\"ops_per_sample\":%zu,"
+           "\"min\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}\n",
+        bench, params, counter_name(), n, per,
+        PCT(0.0), PCT(0.5), PCT(0.9), PCT(0.99), PCT(0.999), PCT(1.0));
+#undef PCT
+    fflush(stdout);
+}
+
+static void yielder(scheduler *sch, void *args) {
+    (void)args;
+    for (;;)
+        coroutine_yield(sch, NULL, NULL);
+}
+
+// resume + yield round trip
+static void bench_roundtrip(int shared) {
+    scheduler *sch = shared ? scheduler_open_shared(0) : scheduler_open(0);
+    coroid_t cid = coroutine_new(sch, yielder, NULL);
+    uint64_t *samples = (uint64_t *)malloc(nsamples * sizeof(uint64_t));
+    for (size_t i = 0; i < 1000; ++i)
+        coroutine_resume(sch, cid, NULL, NULL);
+    for (size_t i = 0; i < nsamples; ++i) {
+        uint64_t t0 = cycles();
+        for (int j = 0; j < BATCH; ++j)
+            coroutine_resume(sch, cid, NULL, NULL);
+        samples[i] = cycles() - t0;
+    }
+    report("roundtrip", shared ? "\"mode\":\"shared\"" : "\"mode\":\"private\"", samples, nsamples, BATCH);
+    free(samples);
+    // the yielder never completes; closing from main frees it anyway
+    scheduler_close(sch);
+}
+
+static void noop(scheduler *sch, void *args) {
+    (void)sch;
+    (void)args;
+}
+
+// create, run to completion; also reports the throughput
+static void bench_spawn(size_t stsize, int shared) {
+    scheduler *sch = shared ? scheduler_open_shared(stsize) : scheduler_open(stsize);
+    uint64_t *samples = (uint64_t *)malloc(nsamples * sizeof(uint64_t));
+    double start = now_s();
+    for (size_t i = 0; i < nsamples; ++i) {
+        uint64_t t0 = cycles();
+        for (int j = 0; j < BATCH; ++j)
+            coroutine_resume(sch, coroutine_new(sch, noop, NULL), NULL, NULL);
+        samples[i] = cycles() - t0;
+    }
+    double elapsed = now_s() - start;
+    char params[128];
+    snprintf(params, sizeof params, "\"mode\":\"%s\",\"stsize\":%zu,\"per_sec\":%.0f",
+        shared ? "shared" : "private", stsize, nsamples * BATCH / elapsed);
+    report("spawn_complete", params, samples, nsamples, BATCH);
+    free(samples);
+    scheduler_close(sch);
+}
+
+// resident set size in bytes
+static size_t rss(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    size_t pages = 0, resident = 0;
+    if (fscanf(f, "%zu %zu", &pages, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+static void parker(scheduler *sch, void *args) {
+    (void)args;
+    char buf[128]; // a bit of live stack, as a real coroutine would have
+    memset(buf, 1, sizeof buf);
+    coroutine_yield(sch, buf, NULL);
+}
+
+// memory held by coroutines that started and are waiting
+static void bench_idle_memory(size_t n, int shared) {
+    scheduler *sch = shared ? scheduler_open_shared(0) : scheduler_open(0);
+    size_t before = rss();
+    for (size_t i = 0; i < n; ++i) {
+        coroid_t cid = coroutine_new(sch, parker, NULL);
+        if (cid < 0)
+            errx(1, "cannot create coroutine");
+        coroutine_resume(sch, cid, NULL, NULL);
+    }
+    // move the last frames off the shared stack too
+    coroutine_resume(sch, coroutine_new(sch, noop, NULL), NULL, NULL);
+    size_t after = rss();
+    printf("{\"bench\":\"idle_memory\",\"mode\":\"%s\",\"coroutines\":%zu,\"rss_bytes\":%zu,"
+           "\"bytes_per_coroutine\":%.1f}\n",
+        shared ? "shared" : "private", n, after - before, (double)(after - before) / n);
+    fflush(stdout);
+    scheduler_close(sch);
+}
+
+struct ring_args {
+    chan *in;
+    chan *out;
+};
+
+// cycles of the last lap of ring_driver()
+static uint64_t ring_lap;
+
+static void ring_node(scheduler *sch, void *args) {
+    (void)sch;
+    struct ring_args *a = (struct ring_args *)args;
+    long token;
+    while (chan_recv(a->in, &token) == 0)
+        if (chan_send(a->out, &token) != 0)
+            break;
+}
+
+static void ring_driver(scheduler *sch, void *args) {
+    (void)sch;
+    struct ring_args *a = (struct ring_args *)args;
+    long token = 0;
+    // the first lap warms up every node
+    chan_send(a->out, &token);
+    chan_recv(a->in, &token);
+    uint64_t t0 = cycles();
+    chan_send(a->out, &token);
+    chan_recv(a->in, &token);
+    ring_lap = cycles() - t0;
+}
+
+// a token passed around a ring of n coroutines over unbuffered channels
+static void bench_pingpong(size_t n) {
+    scheduler *sch = scheduler_open(0);
+    chan **chans = (chan **)malloc((n + 1) * sizeof(chan *));
+    struct ring_args *args = (struct ring_args *)malloc((n + 1) * sizeof(struct ring_args));
+    for (size_t i = 0; i <= n; ++i)
+        chans[i] = CHAN_OPEN(sch, long, 0);
+    for (size_t i = 0; i < n; ++i) {
+        args[i].in = chans[i];
+        args[i].out = chans[i + 1];
+        coroutine_resume(sch, coroutine_new(sch, ring_node, &args[i]), NULL, NULL);
+    }
+    size_t laps = nsamples / n > 10 ? nsamples / n : 10;
+    uint64_t *samples = (uint64_t *)malloc(laps * sizeof(uint64_t));
+    args[n].in = chans[n];
+    args[n].out = chans[0];
+    for (size_t i = 0; i < laps; ++i) {
+        coroid_t d = coroutine_new(sch, ring_driver, &args[n]);
+        coroutine_resume(sch, d, NULL, NULL);
+        samples[i] = ring_lap;
+    }
+    char params[64];
+    snprintf(params, sizeof params, "\"coroutines\":%zu", n);
+    report("pingpong_hop", params, samples, laps, n + 1);
+    for (size_t i = 0; i <= n; ++i)
+        chan_close(chans[i]);
+    for (size_t i = 0; i <= n; ++i)
+        chan_free(chans[i]);
+    free(samples);
+    free(args);
+    free(chans);
+    scheduler_close(sch);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "pn:")) != -1) {
+        switch (opt) {
+            case 'p':
+                if ((perf_fd = perf_open()) == -1)
+                    err(1, "perf_event_open");
+                break;
+            case 'n':
+                nsamples = strtoul(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p] [-n samples]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (nsamples == 0)
+        nsamples = 1;
+
+    bench_roundtrip(0);
+    bench_roundtrip(1);
+    size_t stsizes[] = { SCHEDULER_MIN_ST_SIZE, 256 * 1024, SCHEDULER_MAX_ST_SIZE };
+    for (size_t i = 0; i < sizeof stsizes / sizeof *stsizes; ++i)
+        bench_spawn(stsizes[i], 0);
+    bench_spawn(0, 1);
+    bench_idle_memory(10000, 0);
+    bench_idle_memory(10000, 1);
+    size_t rings[] = { 2, 16, 256 };
+    for (size_t i = 0; i < sizeof rings / sizeof *rings; ++i)
+        bench_pingpong(rings[i]);
+    return 0;
+}
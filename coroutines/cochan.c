@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cochan.h"
+
+#define NEW(TYPE, LEN) (TYPE *)malloc(sizeof(TYPE) * (LEN))
+
+struct selgroup;
+typedef struct selgroup selgroup;
+
+// a case a coroutine waits on. waiters live on the heap rather than on the stack
+// of the waiting coroutine, which might be copied away in shared stack mode
+typedef struct waiter {
+    struct waiter *prev; // in the queue of ch, NULL if not queued
+    struct waiter *next;
+    chan *ch;
+    selgroup *grp;
+    int index;           // index of the case
+    char *val;           // element to send, or the received element
+} waiter;
+
+// the cases of one waiting chan_select()
+struct selgroup {
+    coroid_t cid;        // waiting coroutine
+    int fired;           // index of the completed case, or -1
+    bool ok;             // the case completed without the channel being closed
+    size_t n;
+    waiter w[];          // followed by the elements
+};
+
+struct chan {
+    scheduler *sch;
+    size_t elemsize;
+    size_t cap;          // capacity of buf in elements
+    size_t head;         // index of the first element in buf
+    size_t len;          // elements in buf
+    char *buf;           // ring of elements (malloc)
+    bool closed;
+    waiter sendq;        // waiting senders, list head
+    waiter recvq;        // waiting receivers, list head
+};
+
+static void q_init(waiter *q) {
+    q->prev = q->next = q;
+}
+
+static waiter *q_first(waiter *q) {
+    return q->next == q ? NULL : q->next;
+}
+
+static void q_push(waiter *q, waiter *w) {
+    w->prev = q->prev;
+    w->next = q;
+    q->prev->next = w;
+    q->prev = w;
+}
+
+static void q_remove(waiter *w) {
+    w->prev->next = w->next;
+    w->next->prev = w->prev;
+    w->prev = w->next = NULL;
+}
+
+chan *chan_open(scheduler *sch, size_t elemsize, size_t cap) {
+    chan *ch = NEW(chan, 1);
+    if (ch == NULL)
+        return NULL;
+    ch->buf = NULL;
+    if (cap > 0 && (ch->buf = NEW(char, cap * elemsize)) == NULL) {
+        free(ch);
+        return NULL;
+    }
+    ch->sch = sch;
+    ch->elemsize = elemsize;
+    ch->cap = cap;
+    ch->head = 0;
+    ch->len = 0;
+    ch->closed = false;
+    q_init(&ch->sendq);
+    q_init(&ch->recvq);
+    return ch;
+}
+
+void chan_free(chan *ch) {
+    free(ch->buf);
+    free(ch);
+}
+
+size_t chan_len(chan *ch) {
+    return ch->len;
+}
+
+static void buf_push(chan *ch, const void *elem) {
+    memcpy(ch->buf + ((ch->head + ch->len++) % ch->cap) * ch->elemsize, elem, ch->elemsize);
+}
+
+static void buf_pop(chan *ch, void *elem) {
+    memcpy(elem, ch->buf + ch->head * ch->elemsize, ch->elemsize);
+    ch->head = (ch->head + 1) % ch->cap;
+    --ch->len;
+}
+
+// completes the select of w: dequeues all its cases and switches to the waiting coroutine
+static void fire(waiter *w, bool ok) {
+    selgroup *grp = w->grp;
+    for (size_t i = 0; i < grp->n; ++i)
+        if (grp->w[i].prev != NULL)
+            q_remove(&grp->w[i]);
+    grp->fired = w->index;
+    grp->ok = ok;
+    coroutine_resume(w->ch->sch, grp->cid, NULL, NULL);
+}
+
+void chan_close(chan *ch) {
+    ch->closed = true;
+    waiter *w;
+    while ((w = q_first(&ch->recvq)) != NULL)
+        fire(w, false);
+    while ((w = q_first(&ch->sendq)) != NULL)
+        fire(w, false);
+}
+
+// completes c if it does not have to wait and returns true
+static bool try_case(chan_case *c) {
+    chan *ch = c->ch;
+    waiter *w;
+    if (c->op == CHAN_SEND) {
+        if (ch->closed) {
+            c->ok = false;
+            return true;
+        }
+        c->ok = true;
+        if ((w = q_first(&ch->recvq)) != NULL) {
+            // direct hand-off
+            memcpy(w->val, c->elem, ch->elemsize);
+            fire(w, true);
+            return true;
+        }
+        if (ch->len < ch->cap) {
+            buf_push(ch, c->elem);
+            return true;
+        }
+        return false;
+    }
+
+    c->ok = true;
+    if (ch->len > 0) {
+        buf_pop(ch, c->elem);
+        // the first waiting sender takes the freed place
+        if ((w = q_first(&ch->sendq)) != NULL) {
+            buf_push(ch, w->val);
+            fire(w, true);
+        }
+        return true;
+    }
+    if ((w = q_first(&ch->sendq)) != NULL) {
+        memcpy(c->elem, w->val, ch->elemsize);
+        fire(w, true);
+        return true;
+    }
+    if (ch->closed) {
+        c->ok = false;
+        return true;
+    }
+    return false;
+}
+
+int chan_select(chan_case *cases, size_t n, bool block) {
+    if (n == 0)
+        return -1;
+    // start at a different case each time so that none of them starves
+    static _Thread_local size_t rotate;
+    size_t start = rotate++ % n;
+    for (size_t k = 0; k < n; ++k) {
+        size_t i = (start + k) % n;
+        if (try_case(&cases[i]))
+            return (int)i;
+    }
+
+    scheduler *sch = cases[0].ch->sch;
+    if (!block || coroutine_running(sch) == MAIN_CO_ID)
+        return -1;
+
+    // wait on every case
+    size_t size = sizeof(selgroup) + n * sizeof(waiter);
+    for (size_t i = 0; i < n; ++i)
+        size += cases[i].ch->elemsize;
+    selgroup *grp = (selgroup *)malloc(size);
+    if (grp == NULL)
+        return -1;
+    grp->cid = coroutine_running(sch);
+    grp->fired = -1;
+    grp->n = n;
+    char *val = (char *)&grp->w[n];
+    for (size_t i = 0; i < n; ++i) {
+        waiter *w = &grp->w[i];
+        w->ch = cases[i].ch;
+        w->grp = grp;
+        w->index = (int)i;
+        w->val = val;
+        val += w->ch->elemsize;
+        if (cases[i].op == CHAN_SEND) {
+            memcpy(w->val, cases[i].elem, w->ch->elemsize);
+            q_push(&w->ch->sendq, w);
+        } else {
+            q_push(&w->ch->recvq, w);
+        }
+    }
+
+    // resumes by anyone else than a channel are ignored
+    while (grp->fired < 0)
+        coroutine_yield(sch, NULL, NULL);
+
+    int k = grp->fired;
+    cases[k].ok = grp->ok;
+    if (cases[k].op == CHAN_RECV && grp->ok)
+        memcpy(cases[k].elem, grp->w[k].val, cases[k].ch->elemsize);
+    free(grp);
+    return k;
+}
+
+int chan_send(chan *ch, const void *elem) {
+    chan_case c = { ch, CHAN_SEND, (void *)elem, false };
+    if (chan_select(&c, 1, true) < 0 || !c.ok)
+        return -1;
+    return 0;
+}
+
+int chan_recv(chan *ch, void *elem) {
+    chan_case c = { ch, CHAN_RECV, elem, false };
+    if (chan_select(&c, 1, true) < 0 || !c.ok)
+        return -1;
+    return 0;
+}
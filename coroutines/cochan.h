@@ -0,0 +1,66 @@
+// bounded channels between coroutines of one scheduler
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "coroutines.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct chan;
+typedef struct chan chan;
+
+// creates a channel of elements of elemsize bytes that buffers up to cap elements.
+// cap 0 means every send waits for a receiver
+// NULL is returned if this fails
+chan *chan_open(scheduler *sch, size_t elemsize, size_t cap);
+
+// typed version of chan_open()
+#define CHAN_OPEN(SCH, TYPE, CAP) chan_open((SCH), sizeof(TYPE), (CAP))
+
+// closes the channel: sends fail from now on, receives fail once the buffer is
+// drained, and every waiting coroutine is resumed to see that
+void chan_close(chan *ch);
+
+// frees the channel. no coroutine may be waiting on it
+void chan_free(chan *ch);
+
+// returns the number of buffered elements
+size_t chan_len(chan *ch);
+
+// copies *elem into the channel. if a receiver is waiting, the element is given
+// to it directly and it is resumed right away. if the buffer is full, the running
+// coroutine yields until a receiver takes the element
+// negative code is returned if the channel is closed, or if the main coroutine
+// would have to wait
+int chan_send(chan *ch, const void *elem);
+
+// takes an element from the channel into *elem, waiting for a sender if there is none
+// negative code is returned if the channel is closed and empty, or if the main
+// coroutine would have to wait
+int chan_recv(chan *ch, void *elem);
+
+typedef enum chan_op {
+    CHAN_SEND,
+    CHAN_RECV
+} chan_op;
+
+// one operation of chan_select()
+typedef struct chan_case {
+    chan *ch;
+    chan_op op;
+    void *elem;  // element to send, or where to receive into
+    bool ok;     // set by chan_select(): false if it completed because ch is closed
+} chan_case;
+
+// completes the first ready case and returns its index. if none is ready, waits
+// for one if block is true; otherwise, or if the main coroutine would have to wait,
+// negative code is returned. all channels must belong to the same scheduler
+int chan_select(chan_case *cases, size_t n, bool block);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,380 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "coio.h"
+#include "cotimer.h"
+
+#define NEW(TYPE, LEN) (TYPE *)malloc(sizeof(TYPE) * (LEN))
+
+// events returned by one epoll_wait()
+#define COREACTOR_NEVENTS 256
+
+// coroutines waiting on an fd
+typedef struct fdwait {
+    coroid_t rd;        // waiting to read, or -1
+    coroid_t wr;        // waiting to write, or -1
+    bool registered;    // added to epoll
+} fdwait;
+
+struct cotimeout {
+    cotimer timer;
+    coreactor *r;
+    cotimeout_cb cb;    // user callback, or NULL if a coroutine waits on this
+    void *arg;
+    coroid_t cid;       // the waiting coroutine
+    int fd;             // fd the coroutine waits on, or -1 if it sleeps
+    bool wr;
+    bool fired;
+    cotimeout *nextfree;
+};
+
+struct coreactor {
+    scheduler *sch;
+    int epfd;
+    fdwait *fds;        // index is fd (malloc)
+    size_t nfds;        // size of fds
+    size_t nwaiting;    // coroutines waiting on fds
+    cowheel wheel;      // ticks are milliseconds of CLOCK_MONOTONIC
+    cotimeout *freeto;  // recycled timeouts
+};
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+static cotimeout *timeout_alloc(coreactor *r) {
+    cotimeout *to = r->freeto;
+    if (to != NULL) {
+        r->freeto = to->nextfree;
+        return to;
+    }
+    to = NEW(cotimeout, 1);
+    if (to != NULL)
+        to->timer.pending = 0;
+    return to;
+}
+
+static void timeout_free(coreactor *r, cotimeout *to) {
+    to->nextfree = r->freeto;
+    r->freeto = to;
+}
+
+// callback of every timeout in the wheel
+static void timeout_fire(cotimer *t, void *arg) {
+    (void)t;
+    cotimeout *to = (cotimeout *)arg;
+    coreactor *r = to->r;
+    if (to->cb != NULL) {
+        cotimeout_cb cb = to->cb;
+        void *cbarg = to->arg;
+        timeout_free(r, to);
+        cb(r, cbarg);
+        return;
+    }
+    // a coroutine waits on this; it frees the timeout when it is resumed
+    to->fired = true;
+    if (to->fd >= 0) {
+        coroid_t *slot = to->wr ? &r->fds[to->fd].wr : &r->fds[to->fd].rd;
+        if (*slot != to->cid)
+            return;
+        *slot = -1;
+        --r->nwaiting;
+    }
+    coroutine_resume(r->sch, to->cid, NULL, NULL);
+}
+
+// starts a timeout that resumes the running coroutine after ms milliseconds
+static cotimeout *timeout_start_self(coreactor *r, int ms, int fd, bool wr) {
+    cotimeout *to = timeout_alloc(r);
+    if (to == NULL)
+        return NULL;
+    to->r = r;
+    to->cb = NULL;
+    to->cid = coroutine_running(r->sch);
+    to->fd = fd;
+    to->wr = wr;
+    to->fired = false;
+    // does nothing inside timeout_fire(); the timer then starts from the tick being fired
+    cowheel_advance(&r->wheel, now_ms());
+    cotimer_start(&r->wheel, &to->timer, (uint64_t)ms, timeout_fire, to);
+    return to;
+}
+
+coreactor *coreactor_open(scheduler *sch) {
+    coreactor *r = NEW(coreactor, 1);
+    if (r == NULL)
+        return NULL;
+    r->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epfd == -1) {
+        free(r);
+        return NULL;
+    }
+    r->sch = sch;
+    r->fds = NULL;
+    r->nfds = 0;
+    r->nwaiting = 0;
+    r->freeto = NULL;
+    cowheel_init(&r->wheel, now_ms());
+    return r;
+}
+
+void coreactor_close(coreactor *r) {
+    // pending timeouts are in the wheel
+    for (int l = 0; l < COWHEEL_LEVELS; ++l) {
+        for (int i = 0; i < COWHEEL_SLOTS; ++i) {
+            cotimer *head = &r->wheel.slots[l][i];
+            while (head->next != head) {
+                cotimer *t = head->next;
+                cotimer_cancel(&r->wheel, t);
+                free(t->arg);
+            }
+        }
+    }
+    while (r->freeto != NULL) {
+        cotimeout *next = r->freeto->nextfree;
+        free(r->freeto);
+        r->freeto = next;
+    }
+    close(r->epfd);
+    free(r->fds);
+    free(r);
+}
+
+cotimeout *coreactor_after(coreactor *r, int ms, cotimeout_cb cb, void *arg) {
+    cotimeout *to = timeout_alloc(r);
+    if (to == NULL)
+        return NULL;
+    to->r = r;
+    to->cb = cb;
+    to->arg = arg;
+    // skipped when called from a firing timeout, like in timeout_start_self()
+    cowheel_advance(&r->wheel, now_ms());
+    cotimer_start(&r->wheel, &to->timer, ms < 0 ? 0 : (uint64_t)ms, timeout_fire, to);
+    return to;
+}
+
+void coreactor_cancel(coreactor *r, cotimeout *to) {
+    cotimer_cancel(&r->wheel, &to->timer);
+    timeout_free(r, to);
+}
+
+size_t coreactor_nwaiting(coreactor *r) {
+    return r->nwaiting;
+}
+
+// returns the wait slot of fd, or NULL if this fails
+static fdwait *fd_slot(coreactor *r, int fd) {
+    if (fd < 0)
+        return NULL;
+    if ((size_t)fd >= r->nfds) {
+        size_t newsize = r->nfds ? r->nfds : 64;
+        while (newsize <= (size_t)fd)
+            newsize *= 2;
+        fdwait *fds = (fdwait *)realloc(r->fds, newsize * sizeof(fdwait));
+        if (fds == NULL)
+            return NULL;
+        for (size_t i = r->nfds; i < newsize; ++i) {
+            fds[i].rd = fds[i].wr = -1;
+            fds[i].registered = false;
+        }
+        r->fds = fds;
+        r->nfds = newsize;
+    }
+    return &r->fds[fd];
+}
+
+// parks the running coroutine until fd is readable (or writable if wr), or until
+// timeout_ms passes if it is not negative, and returns 0; nonzero value is returned
+// if this fails, with errno ETIMEDOUT on timeout
+static int wait_fd(coreactor *r, int fd, bool wr, int timeout_ms) {
+    fdwait *w = fd_slot(r, fd);
+    if (w == NULL)
+        return 1;
+    if (!w->registered) {
+        // edge-triggered: an fd is added once, and the io is always tried before waiting
+        struct epoll_event ev;
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+            return 1;
+        w->registered = true;
+    }
+    coroid_t self = coroutine_running(r->sch);
+    coroid_t *slot = wr ? &w->wr : &w->rd;
+    if (*slot >= 0) {
+        errno = EBUSY;
+        return 1;
+    }
+    cotimeout *to = NULL;
+    if (timeout_ms >= 0 && (to = timeout_start_self(r, timeout_ms, fd, wr)) == NULL)
+        return 1;
+    *slot = self;
+    ++r->nwaiting;
+    int res = coroutine_yield(r->sch, NULL, NULL);
+    if (to != NULL) {
+        bool fired = to->fired;
+        cotimer_cancel(&r->wheel, &to->timer);
+        timeout_free(r, to);
+        if (fired) {
+            errno = ETIMEDOUT;
+            return 1;
+        }
+    }
+    // fds might have been reallocated meanwhile. the slot is still ours if this
+    // failed or someone else resumed the coroutine
+    slot = wr ? &r->fds[fd].wr : &r->fds[fd].rd;
+    if (*slot == self) {
+        *slot = -1;
+        --r->nwaiting;
+    }
+    return res != 0;
+}
+
+// wakes the coroutine waiting in *slot, if any
+static void wake(coreactor *r, coroid_t *slot, int *nresumed) {
+    coroid_t cid = *slot;
+    if (cid < 0)
+        return;
+    *slot = -1;
+    --r->nwaiting;
+    if (coroutine_resume(r->sch, cid, NULL, NULL) == 0)
+        ++*nresumed;
+}
+
+int coreactor_run(coreactor *r, int timeout_ms) {
+    // sleep no longer than until the wheel has to be advanced
+    uint64_t next = cowheel_next(&r->wheel);
+    if (next != UINT64_MAX) {
+        uint64_t due = r->wheel.now + next, now = now_ms();
+        uint64_t delay = due > now ? due - now : 0;
+        if (timeout_ms < 0 || delay < (uint64_t)timeout_ms)
+            timeout_ms = (int)delay;
+    }
+
+    struct epoll_event events[COREACTOR_NEVENTS];
+    int n = epoll_wait(r->epfd, events, COREACTOR_NEVENTS, timeout_ms);
+    if (n < 0 && errno != EINTR)
+        return -1;
+
+    int nresumed = (int)cowheel_advance(&r->wheel, now_ms());
+    for (int i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+        uint32_t ev = events[i].events;
+        // the slot is looked up again after each resume, as the coroutine might close fd
+        if (ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            wake(r, &r->fds[fd].rd, &nresumed);
+        if (ev & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            wake(r, &r->fds[fd].wr, &nresumed);
+    }
+    return nresumed;
+}
+
+size_t coreactor_ntimeouts(coreactor *r) {
+    return r->wheel.ntimers;
+}
+
+int co_sleep_ms(coreactor *r, int ms) {
+    cotimeout *to = timeout_start_self(r, ms < 0 ? 0 : ms, -1, false);
+    if (to == NULL)
+        return -1;
+    int res = coroutine_yield(r->sch, NULL, NULL);
+    bool fired = to->fired;
+    cotimer_cancel(&r->wheel, &to->timer);
+    timeout_free(r, to);
+    if (res != 0)
+        return -1;
+    return fired ? 0 : 1;
+}
+
+ssize_t co_read(coreactor *r, int fd, void *buf, size_t count) {
+    return co_read_timed(r, fd, buf, count, -1);
+}
+
+ssize_t co_write(coreactor *r, int fd, const void *buf, size_t count) {
+    return co_write_timed(r, fd, buf, count, -1);
+}
+
+int co_accept(coreactor *r, int fd, struct sockaddr *addr, socklen_t *addrlen) {
+    return co_accept_timed(r, fd, addr, addrlen, -1);
+}
+
+int co_connect(coreactor *r, int fd, const struct sockaddr *addr, socklen_t addrlen) {
+    return co_connect_timed(r, fd, addr, addrlen, -1);
+}
+
+ssize_t co_read_timed(coreactor *r, int fd, void *buf, size_t count, int timeout_ms) {
+    for (;;) {
+        ssize_t ret = read(fd, buf, count);
+        if (ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return ret;
+        if (errno != EINTR && wait_fd(r, fd, false, timeout_ms) != 0)
+            return -1;
+    }
+}
+
+ssize_t co_write_timed(coreactor *r, int fd, const void *buf, size_t count, int timeout_ms) {
+    for (;;) {
+        ssize_t ret = write(fd, buf, count);
+        if (ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+            return ret;
+        if (errno != EINTR && wait_fd(r, fd, true, timeout_ms) != 0)
+            return -1;
+    }
+}
+
+int co_accept_timed(coreactor *r, int fd, struct sockaddr *addr, socklen_t *addrlen, int timeout_ms) {
+    for (;;) {
+        int ret = accept4(fd, addr, addrlen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (ret >= 0)
+            return ret;
+        if (errno == EPROTO || errno == ECONNABORTED || errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+            return ret;
+        if (wait_fd(r, fd, false, timeout_ms) != 0)
+            return -1;
+    }
+}
+
+int co_connect_timed(coreactor *r, int fd, const struct sockaddr *addr, socklen_t addrlen,
+                     int timeout_ms) {
+    if (connect(fd, addr, addrlen) == 0)
+        return 0;
+    if (errno != EINPROGRESS)
+        return -1;
+    // the result is known when the socket becomes writable
+    if (wait_fd(r, fd, true, timeout_ms) != 0)
+        return -1;
+    int soerr;
+    socklen_t len = sizeof soerr;
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &soerr, &len) == -1)
+        return -1;
+    if (soerr != 0) {
+        errno = soerr;
+        return -1;
+    }
+    return 0;
+}
+
+int co_close(coreactor *r, int fd) {
+    if (fd >= 0 && (size_t)fd < r->nfds) {
+        fdwait *w = &r->fds[fd];
+        if (w->registered)
+            epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+        if (w->rd >= 0)
+            --r->nwaiting;
+        if (w->wr >= 0)
+            --r->nwaiting;
+        w->rd = w->wr = -1;
+        w->registered = false;
+    }
+    return close(fd);
+}
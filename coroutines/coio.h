@@ -0,0 +1,86 @@
+// epoll-driven socket io for coroutines of a scheduler
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "coroutines.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct coreactor;
+typedef struct coreactor coreactor;
+
+// a timer of the reactor. the reactor keeps a hierarchical timing wheel with
+// millisecond ticks, so starting and cancelling one takes constant time
+struct cotimeout;
+typedef struct cotimeout cotimeout;
+
+typedef void (*cotimeout_cb)(coreactor *r, void *arg);
+
+// creates a reactor for the coroutines of sch
+// NULL is returned if this fails
+coreactor *coreactor_open(scheduler *sch);
+
+// frees the reactor. coroutines still waiting on it are never resumed by it
+void coreactor_close(coreactor *r);
+
+// waits up to timeout_ms (-1 means forever) for the fds that coroutines are waiting on,
+// but no longer than until the next timeout is due. then resumes every coroutine whose
+// fd became ready and fires due timeouts. must be called from the coroutine that is
+// resumed when a waiting coroutine yields, normally the main coroutine
+// the number of resumed coroutines and fired timeouts is returned, or negative code
+// if this fails
+int coreactor_run(coreactor *r, int timeout_ms);
+
+// returns the number of coroutines waiting on fds
+size_t coreactor_nwaiting(coreactor *r);
+
+// returns the number of pending timeouts, including sleeping coroutines
+size_t coreactor_ntimeouts(coreactor *r);
+
+// calls cb(r, arg) from coreactor_run() after ms milliseconds
+// NULL is returned if this fails
+cotimeout *coreactor_after(coreactor *r, int ms, cotimeout_cb cb, void *arg);
+
+// stops a timeout that has not fired yet; it must not be used afterwards
+void coreactor_cancel(coreactor *r, cotimeout *to);
+
+// the functions below are called in coroutines other than the main coroutine, on
+// non-blocking fds. when the fd is not ready, the coroutine yields to its resumer
+// until the reactor resumes it. they return like their system calls otherwise
+
+ssize_t co_read(coreactor *r, int fd, void *buf, size_t count);
+
+ssize_t co_write(coreactor *r, int fd, const void *buf, size_t count);
+
+// the accepted fd is non-blocking
+int co_accept(coreactor *r, int fd, struct sockaddr *addr, socklen_t *addrlen);
+
+int co_connect(coreactor *r, int fd, const struct sockaddr *addr, socklen_t addrlen);
+
+// the _timed variants give up after timeout_ms milliseconds of waiting with
+// errno ETIMEDOUT; -1 means no timeout
+
+ssize_t co_read_timed(coreactor *r, int fd, void *buf, size_t count, int timeout_ms);
+
+ssize_t co_write_timed(coreactor *r, int fd, const void *buf, size_t count, int timeout_ms);
+
+int co_accept_timed(coreactor *r, int fd, struct sockaddr *addr, socklen_t *addrlen, int timeout_ms);
+
+int co_connect_timed(coreactor *r, int fd, const struct sockaddr *addr, socklen_t addrlen,
+                     int timeout_ms);
+
+// yields until ms milliseconds pass. 0 is returned then, 1 if the coroutine was
+// resumed by someone else earlier, or negative code if this fails
+int co_sleep_ms(coreactor *r, int ms);
+
+// closes the fd and forgets about it
+int co_close(coreactor *r, int fd);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,377 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "copool.h"
+
+#define NEW(TYPE, LEN) (TYPE *)malloc(sizeof(TYPE) * (LEN))
+
+struct worker;
+typedef struct worker worker;
+
+struct cotask {
+    yieldable func;     // function
+    void *args;         // userdata
+    coroid_t cid;       // id in the scheduler of the worker once started, or -1
+    worker *owner;      // worker that started it
+    atomic_bool done;   // completed
+    bool failed;        // could not be started; set before done
+    atomic_int refs;    // the pool and the handle
+    cotask *waiter;     // task parked in copool_join() on this one; guarded by pool->mtx
+    cotask *nextwoken;  // link in the woken list of its owner
+};
+
+// growable ring of tasks
+typedef struct taskring {
+    cotask **buf;
+    size_t head;        // index of the first task
+    size_t len;         // number of tasks
+    size_t cap;         // power of two
+} taskring;
+
+struct worker {
+    copool *pool;
+    size_t id;
+    scheduler *sch;
+    pthread_t thread;
+    pthread_mutex_t mtx; // guards ready, which thieves take from
+    taskring ready;      // not started yet; the owner pops the back, thieves the front
+    taskring started;    // started and yielded; only touched by the owner
+    unsigned long tick;  // alternates between ready and started
+    size_t nstarted;     // started tasks not completed yet, parked ones too
+    cotask *current;     // task being resumed
+    cotask *woken;       // parked tasks whose join is over; guarded by pool->mtx
+    cotask *wokentail;
+    atomic_size_t nwoken;
+};
+
+struct copool {
+    worker *workers;
+    size_t nworkers;
+    atomic_size_t nready;  // tasks in all ready rings
+    atomic_size_t nlive;   // tasks not completed yet
+    atomic_size_t next;    // next worker for spawns from other threads
+    bool stopping;         // copool_close() was called
+    pthread_mutex_t mtx;   // guards stopping and the waits below
+    pthread_cond_t workcv; // work available or stopping
+    pthread_cond_t donecv; // some task completed
+};
+
+// the worker of this thread, NULL outside the pool
+static _Thread_local worker *self;
+
+// yielded by a task that parks in copool_join(), so that its worker does not
+// requeue it until the joined task completes
+static char parked;
+
+// makes room for n tasks in all
+static int ring_reserve(taskring *r, size_t n) {
+    if (n > r->cap) {
+        size_t newcap = r->cap ? r->cap * 2 : 64;
+        while (newcap < n)
+            newcap *= 2;
+        cotask **buf = NEW(cotask *, newcap);
+        if (buf == NULL)
+            return 1;
+        for (size_t i = 0; i < r->len; ++i)
+            buf[i] = r->buf[(r->head + i) & (r->cap - 1)];
+        free(r->buf);
+        r->buf = buf;
+        r->head = 0;
+        r->cap = newcap;
+    }
+    return 0;
+}
+
+static int ring_push_back(taskring *r, cotask *t) {
+    if (ring_reserve(r, r->len + 1) != 0)
+        return 1;
+    r->buf[(r->head + r->len++) & (r->cap - 1)] = t;
+    return 0;
+}
+
+static cotask *ring_pop_back(taskring *r) {
+    if (r->len == 0)
+        return NULL;
+    return r->buf[(r->head + --r->len) & (r->cap - 1)];
+}
+
+static cotask *ring_pop_front(taskring *r) {
+    if (r->len == 0)
+        return NULL;
+    cotask *t = r->buf[r->head];
+    r->head = (r->head + 1) & (r->cap - 1);
+    --r->len;
+    return t;
+}
+
+static void task_unref(cotask *task) {
+    if (atomic_fetch_sub(&task->refs, 1) == 1)
+        free(task);
+}
+
+static void task_entry(scheduler *sch, void *args) {
+    cotask *task = (cotask *)args;
+    task->func(sch, task->args);
+}
+
+// marks the task completed and wakes up joiners and copool_close(). a task parked
+// on it goes back to its worker
+static void task_complete(copool *pool, cotask *task) {
+    pthread_mutex_lock(&pool->mtx);
+    atomic_store(&task->done, true);
+    size_t live = atomic_fetch_sub(&pool->nlive, 1) - 1;
+    pthread_cond_broadcast(&pool->donecv);
+    cotask *waiter = task->waiter;
+    if (waiter != NULL) {
+        worker *w = waiter->owner;
+        waiter->nextwoken = NULL;
+        if (w->wokentail == NULL)
+            w->woken = waiter;
+        else
+            w->wokentail->nextwoken = waiter;
+        w->wokentail = waiter;
+        atomic_fetch_add(&w->nwoken, 1);
+    }
+    // workers share the condition, so the one of the waiter has to be among them
+    if (waiter != NULL || (live == 0 && pool->stopping))
+        pthread_cond_broadcast(&pool->workcv);
+    pthread_mutex_unlock(&pool->mtx);
+    task_unref(task);
+}
+
+// takes a task that has not started from another worker
+static cotask *steal(worker *w) {
+    copool *pool = w->pool;
+    for (size_t i = 1; i < pool->nworkers; ++i) {
+        worker *victim = &pool->workers[(w->id + i) % pool->nworkers];
+        pthread_mutex_lock(&victim->mtx);
+        cotask *t = ring_pop_front(&victim->ready);
+        pthread_mutex_unlock(&victim->mtx);
+        if (t != NULL) {
+            atomic_fetch_sub(&pool->nready, 1);
+            return t;
+        }
+    }
+    return NULL;
+}
+
+static cotask *take_ready(worker *w) {
+    pthread_mutex_lock(&w->mtx);
+    cotask *t = ring_pop_back(&w->ready);
+    pthread_mutex_unlock(&w->mtx);
+    if (t != NULL) {
+        atomic_fetch_sub(&w->pool->nready, 1);
+        return t;
+    }
+    return steal(w);
+}
+
+// takes a parked task whose join is over
+static cotask *take_woken(worker *w) {
+    if (atomic_load(&w->nwoken) == 0)
+        return NULL;
+    pthread_mutex_lock(&w->pool->mtx);
+    cotask *t = w->woken;
+    w->woken = t->nextwoken;
+    if (w->woken == NULL)
+        w->wokentail = NULL;
+    atomic_fetch_sub(&w->nwoken, 1);
+    pthread_mutex_unlock(&w->pool->mtx);
+    return t;
+}
+
+// picks the next task to resume, or sleeps until there is one. NULL is returned
+// if the pool is stopping and every task has completed
+static cotask *next_task(worker *w) {
+    copool *pool = w->pool;
+    for (;;) {
+        cotask *t = NULL;
+        // alternate so neither new nor yielded coroutines starve the others
+        if (++w->tick & 1)
+            t = ring_pop_front(&w->started);
+        if (t == NULL)
+            t = take_woken(w);
+        if (t == NULL)
+            t = take_ready(w);
+        if (t == NULL)
+            t = ring_pop_front(&w->started);
+        if (t != NULL)
+            return t;
+
+        pthread_mutex_lock(&pool->mtx);
+        while (atomic_load(&pool->nready) == 0 && atomic_load(&w->nwoken) == 0 &&
+               !(pool->stopping && atomic_load(&pool->nlive) == 0))
+            pthread_cond_wait(&pool->workcv, &pool->mtx);
+        bool finished = atomic_load(&pool->nready) == 0 && atomic_load(&w->nwoken) == 0;
+        pthread_mutex_unlock(&pool->mtx);
+        if (finished)
+            return NULL;
+    }
+}
+
+static void *worker_run(void *arg) {
+    worker *w = (worker *)arg;
+    self = w;
+    cotask *task;
+    while ((task = next_task(w)) != NULL) {
+        if (task->cid < 0) {
+            // a started task is always requeued, so there is room for every one
+            if (ring_reserve(&w->started, w->nstarted + 1) != 0
+                || (task->cid = coroutine_new(w->sch, task_entry, task)) < 0) {
+                task->failed = true;
+                task_complete(w->pool, task);
+                continue;
+            }
+            task->owner = w;
+            ++w->nstarted;
+        }
+        void *yielded;
+        w->current = task;
+        coroutine_resume(w->sch, task->cid, NULL, &yielded);
+        w->current = NULL;
+        if (coroutine_status(w->sch, task->cid) == CO_STATUS_COMPLETED) {
+            --w->nstarted;
+            task_complete(w->pool, task);
+        } else if (yielded != &parked)
+            (void)ring_push_back(&w->started, task);
+    }
+    self = NULL;
+    return NULL;
+}
+
+// stops the workers whose threads were started, then frees the pool with the
+// first nsch schedulers
+static void pool_free(copool *pool, size_t nsch, size_t nthreads) {
+    pthread_mutex_lock(&pool->mtx);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->workcv);
+    pthread_mutex_unlock(&pool->mtx);
+
+    for (size_t i = 0; i < nthreads; ++i)
+        pthread_join(pool->workers[i].thread, NULL);
+    for (size_t i = 0; i < pool->nworkers; ++i) {
+        worker *w = &pool->workers[i];
+        if (i < nsch)
+            scheduler_close(w->sch);
+        free(w->ready.buf);
+        free(w->started.buf);
+        pthread_mutex_destroy(&w->mtx);
+    }
+    pthread_cond_destroy(&pool->donecv);
+    pthread_cond_destroy(&pool->workcv);
+    pthread_mutex_destroy(&pool->mtx);
+    free(pool->workers);
+    free(pool);
+}
+
+copool *copool_open(size_t nworkers, size_t stsize) {
+    if (nworkers == 0)
+        nworkers = COPOOL_DEFAULT_WORKERS;
+    copool *pool = NEW(copool, 1);
+    if (pool == NULL)
+        return NULL;
+    pool->workers = (worker *)calloc(nworkers, sizeof(worker));
+    if (pool->workers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pool->nworkers = nworkers;
+    atomic_init(&pool->nready, 0);
+    atomic_init(&pool->nlive, 0);
+    atomic_init(&pool->next, 0);
+    pool->stopping = false;
+    pthread_mutex_init(&pool->mtx, NULL);
+    pthread_cond_init(&pool->workcv, NULL);
+    pthread_cond_init(&pool->donecv, NULL);
+    for (size_t i = 0; i < nworkers; ++i) {
+        worker *w = &pool->workers[i];
+        w->pool = pool;
+        w->id = i;
+        atomic_init(&w->nwoken, 0);
+        pthread_mutex_init(&w->mtx, NULL);
+    }
+
+    // schedulers are created here; each is only used by its worker afterwards
+    for (size_t i = 0; i < nworkers; ++i) {
+        if ((pool->workers[i].sch = scheduler_open(stsize)) == NULL) {
+            pool_free(pool, i, 0);
+            return NULL;
+        }
+    }
+    for (size_t i = 0; i < nworkers; ++i) {
+        if (pthread_create(&pool->workers[i].thread, NULL, worker_run, &pool->workers[i]) != 0) {
+            pool_free(pool, nworkers, i);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+void copool_close(copool *pool) {
+    pool_free(pool, pool->nworkers, pool->nworkers);
+}
+
+cotask *copool_spawn(copool *pool, yieldable f, void *args) {
+    cotask *task = NEW(cotask, 1);
+    if (task == NULL)
+        return NULL;
+    task->func = f;
+    task->args = args;
+    task->cid = -1;
+    task->owner = NULL;
+    task->failed = false;
+    task->waiter = NULL;
+    task->nextwoken = NULL;
+    atomic_init(&task->done, false);
+    atomic_init(&task->refs, 2);
+
+    worker *w = self != NULL && self->pool == pool
+        ? self
+        : &pool->workers[atomic_fetch_add(&pool->next, 1) % pool->nworkers];
+    // counted before it can be taken, so the counters never go below zero
+    atomic_fetch_add(&pool->nlive, 1);
+    atomic_fetch_add(&pool->nready, 1);
+    pthread_mutex_lock(&w->mtx);
+    int res = ring_push_back(&w->ready, task);
+    pthread_mutex_unlock(&w->mtx);
+    if (res != 0) {
+        atomic_fetch_sub(&pool->nready, 1);
+        atomic_fetch_sub(&pool->nlive, 1);
+        free(task);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&pool->mtx);
+    pthread_cond_signal(&pool->workcv);
+    pthread_mutex_unlock(&pool->mtx);
+    return task;
+}
+
+int copool_join(copool *pool, cotask *task) {
+    if (self != NULL && self->pool == pool) {
+        // park until task_complete() hands this task back to its worker, which
+        // runs other coroutines or sleeps meanwhile
+        pthread_mutex_lock(&pool->mtx);
+        bool wait = !atomic_load(&task->done);
+        if (wait)
+            task->waiter = self->current;
+        pthread_mutex_unlock(&pool->mtx);
+        if (wait)
+            coroutine_yield(self->sch, &parked, NULL);
+    } else {
+        pthread_mutex_lock(&pool->mtx);
+        while (!atomic_load(&task->done))
+            pthread_cond_wait(&pool->donecv, &pool->mtx);
+        pthread_mutex_unlock(&pool->mtx);
+    }
+    int res = task->failed ? -1 : 0;
+    task_unref(task);
+    return res;
+}
+
+void copool_detach(copool *pool, cotask *task) {
+    (void)pool;
+    task_unref(task);
+}
@@ -0,0 +1,51 @@
+// a pool of worker threads running coroutines, each worker with its own scheduler
+#pragma once
+
+#include <stddef.h>
+
+#include "coroutines.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// number of workers if 0 is passed to copool_open()
+#define COPOOL_DEFAULT_WORKERS 4
+
+struct copool;
+typedef struct copool copool;
+
+// handle of a coroutine spawned into the pool
+struct cotask;
+typedef struct cotask cotask;
+
+// starts nworkers threads, each running a scheduler with stack size stsize
+// (see scheduler_open()). 0 means use default
+// NULL is returned if this fails
+copool *copool_open(size_t nworkers, size_t stsize);
+
+// waits for every spawned coroutine to complete, then stops the workers and
+// frees the pool. tasks that are neither joined nor detached are leaked
+void copool_close(copool *pool);
+
+// spawns f(sch, args) into the pool. if called from a worker, it goes to that worker's
+// queue, otherwise to the workers in turn. idle workers steal coroutines that have not
+// started yet from the others. once started, a coroutine stays on its worker since its
+// stack and id belong to that scheduler; coroutine_yield() lets the worker run others.
+// the values passed by coroutine_yield() are discarded
+// NULL is returned if this fails
+cotask *copool_spawn(copool *pool, yieldable f, void *args);
+
+// waits for the task to complete and frees it. inside a coroutine of the pool, this
+// parks the coroutine until then instead of blocking the worker, which runs other
+// coroutines meanwhile or sleeps. only one joiner is allowed per task
+// negative code is returned if the task could not be started by its worker, in
+// which case f never ran
+int copool_join(copool *pool, cotask *task);
+
+// frees the task when it completes, or fails to start; it must not be used afterwards
+void copool_detach(copool *pool, cotask *task);
+
+#ifdef __cplusplus
+}
+#endif
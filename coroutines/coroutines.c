@@ -1,138 +1,570 @@
 #include <err.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ucontext.h>
+#include <unistd.h>
+#include <sys/mman.h>
 
 #include "coroutines.h"
 
+// pick the context switching backend. the hand-written switch only saves the
+// callee-saved registers and never enters the kernel, while swapcontext()
+// also saves the signal mask with a rt_sigprocmask syscall on every switch
+#if !defined(CO_USE_UCONTEXT) && !defined(__x86_64__) && !defined(__aarch64__)
+    #define CO_USE_UCONTEXT
+#endif
+
+#ifdef CO_USE_UCONTEXT
+    #include <ucontext.h>
+#endif
+
+#ifdef CO_ENABLE_STATS
+    #include <time.h>
+#endif
+
 #define MIN(a, b) ((a) > (b) ? (b) : (a))
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
 
 struct coroutine;
 typedef struct coroutine coroutine;
 
+#ifdef CO_USE_UCONTEXT
+typedef ucontext_t cocontext;
+#else
+// saved stack pointer. everything else lives on the stack it points to
+typedef struct cocontext {
+    void *sp;
+} cocontext;
+
+// saves callee-saved registers of the caller on its stack, stores the stack
+// pointer to *from_sp, then restores the registers saved on to_sp and returns there
+void co_swap(void **from_sp, void *to_sp) __asm__("ctut_co_swap");
+// first return address of a new context; calls the function in a callee-saved
+// register with the argument in another callee-saved register. never returns
+void co_entry(void) __asm__("ctut_co_entry");
+
+#if defined(__x86_64__)
+// frame: mxcsr + x87 control word, r15, r14, r13, r12, rbx, rbp, return address
+__asm__(
+    ".text\n"
+    ".p2align 4\n"
+    "ctut_co_swap:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".p2align 4\n"
+    "ctut_co_entry:\n"
+    "    movq %r12, %rdi\n"
+    "    callq *%r13\n"
+    "    ud2\n"
+);
+#define CO_FRAME_WORDS 8
+#elif defined(__aarch64__)
+// frame: x19-x28, x29 (fp), x30 (lr), d8-d15
+__asm__(
+    ".text\n"
+    ".p2align 4\n"
+    "ctut_co_swap:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x2, sp\n"
+    "    str x2, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".p2align 4\n"
+    "ctut_co_entry:\n"
+    "    mov x0, x19\n"
+    "    blr x20\n"
+    "    brk #0\n"
+);
+#define CO_FRAME_WORDS 20
+#endif
+#endif
+
 struct scheduler {
     coroid_t running; // id of running coroutine
-    size_t stsize;    // stack size
+    size_t stsize;    // stack size, multiple of page size
+    size_t pgsize;    // page size, also the size of the guard page below each stack
+    char *stpool;     // free stacks, linked through their lowest word (mmap)
+    size_t nstpool;   // number of stacks in stpool
     size_t nco;       // number of coroutines
     size_t cap;       // max number of coroutines
-    coroutine **co;   // array of coroutines, the index is coroutine id (malloc)
+    coroutine **co;   // array of coroutines, the index is the index part of coroutine id (malloc)
+    int freeco;       // index of the first free slot, or -1
+    int freetail;     // index of the last free slot, or -1
     void *yd;         // yield x. yielded result from callee to caller
     void *sd;         // sent result from the caller to callee
+    // shared stack mode, all fields are NULL otherwise
+    char *shstack;      // the stack every coroutine runs on (mmap)
+    coroutine *showner; // coroutine whose frames are currently on shstack
+    char *swstack;      // small stack to move frames on and off shstack (mmap)
+    coroutine *swto;    // coroutine to switch to from swstack
+    cocontext swctx;    // context running on swstack
 };
 
 struct coroutine {
-    char *stack;      // stack (malloc)
+    char *stack;      // stack above the guard page (mmap), or NULL if not owning one
     scheduler *sch;   // scheduler that runs this
     yieldable func;   // function
     void *args;       // userdata
-    ucontext_t ctx;   // context of coroutine
+    cocontext ctx;    // context of coroutine
     co_status status; // status
     coroid_t prevco;  // previous coroutine id that resumes the current coroutine
+    int gen;          // generation of the slot, bumped on every reuse
+    int nextfree;     // index of the next free slot if this is free, or -1
+    // shared stack mode
+    char *stsave;     // live part of the stack while shstack is used by others (malloc)
+    size_t stsavelen; // bytes in stsave
+    size_t stsavecap; // capacity of stsave
+    int fresh;        // never ran, the initial frame is not built yet
+#ifdef CO_USE_UCONTEXT
+    char *stlow;      // lowest address of the stack that might be live when switched out
+#endif
+#ifdef CO_ENABLE_STATS
+    unsigned long long resumes;
+    unsigned long long run_ns;
+    unsigned long long pending_ns;
+    unsigned long long since; // when it last started running or became pending
+    size_t sthigh;            // stack high-water mark found so far
+#endif
 };
 
-scheduler *scheduler_open(size_t stsize) {
+#define CO_INDEX_MASK ((1 << COROID_INDEX_BITS) - 1)
+#define CO_GEN_MASK ((1 << (31 - COROID_INDEX_BITS)) - 1)
+#define CO_INDEX(id) ((id) & CO_INDEX_MASK)
+#define CO_GEN(id) ((id) >> COROID_INDEX_BITS)
+#define CO_ID(index, gen) ((coroid_t)(((gen) << COROID_INDEX_BITS) | (index)))
+// the coroutine running now
+#define CO_RUNNING(sch) ((sch)->co[CO_INDEX((sch)->running)])
+
+// bytes below the frame of the switching function that swapcontext() might use
+#define CO_SWITCH_SLACK 512
+
+// maps size bytes of stack with a PROT_NONE guard page below it. pages are only
+// committed when touched. returns NULL if this fails
+static char *stack_map(scheduler *sch, size_t size) {
+    char *base = (char *)mmap(NULL, size + sch->pgsize, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base, sch->pgsize, PROT_NONE) != 0) {
+        munmap(base, size + sch->pgsize);
+        return NULL;
+    }
+    return base + sch->pgsize;
+}
+
+static void stack_unmap(scheduler *sch, char *stack, size_t size) {
+    munmap(stack - sch->pgsize, size + sch->pgsize);
+}
+
+// takes a stack of sch->stsize from the pool, or maps a new one
+static char *stack_alloc(scheduler *sch) {
+    if (sch->stpool != NULL) {
+        char *stack = sch->stpool;
+        sch->stpool = *(char **)stack;
+        --sch->nstpool;
+        return stack;
+    }
+    return stack_map(sch, sch->stsize);
+}
+
+// returns the stack to the pool of the scheduler, or unmaps it if the pool is full
+static void stack_release(scheduler *sch, char *stack) {
+    if (sch->nstpool < SCHEDULER_ST_POOL_SIZE) {
+        *(char **)stack = sch->stpool;
+        sch->stpool = stack;
+        ++sch->nstpool;
+    } else {
+        stack_unmap(sch, stack, sch->stsize);
+    }
+}
+
+static void cofunc(scheduler *sch);
+static void shstack_switcher(scheduler *sch);
+
+// prepares ctx so that switching to it runs fn(sch) on the given stack
+static void context_init(cocontext *ctx, char *stack, size_t stsize,
+                         void (*fn)(scheduler *), scheduler *sch) {
+#ifdef CO_USE_UCONTEXT
+    getcontext(ctx);
+    ctx->uc_stack.ss_sp = stack;
+    ctx->uc_stack.ss_size = stsize;
+    ctx->uc_link = NULL;
+    makecontext(ctx, (void(*)(void))fn, 1, sch);
+#else
+    uintptr_t top = ((uintptr_t)stack + stsize) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+    // the stack is 16-byte aligned right after popping the return address,
+    // so the call in co_entry gives fn the alignment the abi expects
+    void **frame = (void **)(top - 16 - CO_FRAME_WORDS * sizeof(void *));
+    memset(frame, 0, CO_FRAME_WORDS * sizeof(void *));
+    ((unsigned *)frame)[0] = 0x1F80;       // default mxcsr
+    ((unsigned short *)frame)[2] = 0x037F; // default x87 control word
+    frame[3] = (void *)fn;                 // r13
+    frame[4] = (void *)sch;                // r12
+    frame[7] = (void *)co_entry;           // return address
+#elif defined(__aarch64__)
+    void **frame = (void **)(top - CO_FRAME_WORDS * sizeof(void *));
+    memset(frame, 0, CO_FRAME_WORDS * sizeof(void *));
+    frame[0] = (void *)sch;                // x19
+    frame[1] = (void *)fn;                 // x20
+    frame[11] = (void *)co_entry;          // x30
+#endif
+    ctx->sp = frame;
+#endif
+}
+
+// saves the current context to from and continues from to
+static inline void context_swap(cocontext *from, cocontext *to) {
+#ifdef CO_USE_UCONTEXT
+    swapcontext(from, to);
+#else
+    co_swap(&from->sp, to->sp);
+#endif
+}
+
+// whether co runs on the shared stack
+#define ON_SHSTACK(sch, co) ((sch)->shstack != NULL && (co)->func != NULL)
+
+// lowest live address of a switched-out coroutine
+#ifdef CO_USE_UCONTEXT
+    #define CONTEXT_LOW(co) ((co)->stlow)
+#else
+    #define CONTEXT_LOW(co) ((char *)(co)->ctx.sp)
+#endif
+
+// moves the frames of the current owner of the shared stack out to its save
+// buffer and puts the frames of co in. must not run on the shared stack
+static void shstack_acquire(scheduler *sch, coroutine *co) {
+    char *top = sch->shstack + sch->stsize;
+    coroutine *owner = sch->showner;
+    if (owner != NULL && owner->status != CO_STATUS_COMPLETED) {
+        char *low = MAX(CONTEXT_LOW(owner), sch->shstack);
+        size_t len = (size_t)(top - low);
+        if (len > owner->stsavecap || len < owner->stsavecap / 4) {
+            char *buf = (char *)realloc(owner->stsave, len);
+            if (buf == NULL)
+                errx(1, "cannot save coroutine stack");
+            owner->stsave = buf;
+            owner->stsavecap = len;
+        }
+        memcpy(owner->stsave, low, len);
+        owner->stsavelen = len;
+#ifdef CO_ENABLE_STATS
+        if (len > owner->sthigh)
+            owner->sthigh = len;
+#endif
+    }
+    if (co->fresh) {
+        context_init(&co->ctx, sch->shstack, sch->stsize, cofunc, sch);
+        co->fresh = 0;
+    } else {
+        memcpy(top - co->stsavelen, co->stsave, co->stsavelen);
+    }
+    sch->showner = co;
+}
+
+// runs on the switch stack whenever a coroutine on the shared stack switches
+// to another one, since neither of them can overwrite the stack it runs on
+static void shstack_switcher(scheduler *sch) {
+    for (;;) {
+        coroutine *to = sch->swto;
+        shstack_acquire(sch, to);
+        context_swap(&sch->swctx, &to->ctx);
+    }
+}
+
+// saves the context of from and continues from to, moving frames around if
+// they share the stack
+static void co_switch(scheduler *sch, coroutine *from, coroutine *to) {
+#ifdef CO_USE_UCONTEXT
+    char mark;
+    from->stlow = (char *)((uintptr_t)&mark - CO_SWITCH_SLACK);
+#endif
+    if (!ON_SHSTACK(sch, to) || sch->showner == to) {
+        context_swap(&from->ctx, &to->ctx);
+    } else if (!ON_SHSTACK(sch, from)) {
+        shstack_acquire(sch, to);
+        context_swap(&from->ctx, &to->ctx);
+    } else {
+        sch->swto = to;
+        context_swap(&from->ctx, &sch->swctx);
+    }
+}
+
+// appends a slot to the free list. slots are reused in the order they were freed,
+// so that a slot takes as long as possible to come back and wrap its generation
+static void free_push(scheduler *sch, int index) {
+    sch->co[index]->nextfree = -1;
+    if (sch->freetail < 0)
+        sch->freeco = index;
+    else
+        sch->co[sch->freetail]->nextfree = index;
+    sch->freetail = index;
+}
+
+// adds slots [sch->cap, newcap) to the slot array and links them to the free
+// list. their control blocks come from one malloc'ed slab, which starts at
+// index 0, SCHEDULER_CO_SIZE, 2*SCHEDULER_CO_SIZE, 4*SCHEDULER_CO_SIZE...
+static int slots_grow(scheduler *sch, size_t newcap) {
+    if (newcap > (size_t)CO_INDEX_MASK + 1)
+        return 1;
+    size_t n = newcap - sch->cap;
+    coroutine **newco = (coroutine **)realloc(sch->co, newcap * sizeof(coroutine *));
+    if (newco == NULL)
+        return 1;
+    sch->co = newco;
+    coroutine *slab = (coroutine *)malloc(n * sizeof(coroutine));
+    if (slab == NULL)
+        return 1;
+    // lower indices are handed out first
+    for (size_t i = 0; i < n; ++i) {
+        coroutine *co = &slab[i];
+        co->stack = NULL;
+        co->status = CO_STATUS_NEXIST;
+        co->stsave = NULL;
+        co->stsavecap = 0;
+        co->gen = 0;
+        sch->co[sch->cap + i] = co;
+        free_push(sch, (int)(sch->cap + i));
+    }
+    sch->cap = newcap;
+    return 0;
+}
+
+#ifdef CO_ENABLE_STATS
+// painted over private stacks to find how deep they have been used
+#define CO_CANARY 0xC5C5C5C5C5C5C5C5ULL
+// only this much of the top of a stack is painted, so the rest of it is still
+// committed lazily. deeper use is reported as the whole window
+#ifndef CO_STATS_PAINT
+#define CO_STATS_PAINT (64 * 1024)
+#endif
+
+// the lowest painted word of a private stack
+static uint64_t *paint_low(scheduler *sch, coroutine *co) {
+    size_t len = MIN(sch->stsize, (size_t)CO_STATS_PAINT);
+    return (uint64_t *)(co->stack + sch->stsize - len);
+}
+
+static unsigned long long now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+static void stats_init(scheduler *sch, coroutine *co) {
+    co->resumes = 0;
+    co->run_ns = 0;
+    co->pending_ns = 0;
+    co->since = now_ns();
+    co->sthigh = 0;
+    if (co->stack != NULL) {
+        uint64_t *end = (uint64_t *)(co->stack + sch->stsize);
+        for (uint64_t *p = paint_low(sch, co); p < end; ++p)
+            *p = CO_CANARY;
+    }
+}
+
+// from stops running and to starts running; to was pending if it is being resumed
+static void stats_switch(coroutine *from, coroutine *to, int resumed) {
+    unsigned long long now = now_ns();
+    from->run_ns += now - from->since;
+    from->since = now;
+    if (resumed) {
+        ++to->resumes;
+        to->pending_ns += now - to->since;
+    }
+    to->since = now;
+}
+
+// scans the painted window of co for the deepest overwritten canary
+static size_t stack_high_water(scheduler *sch, coroutine *co) {
+    if (co->stack != NULL) {
+        const uint64_t *p = paint_low(sch, co),
+                       *end = (const uint64_t *)(co->stack + sch->stsize);
+        while (p < end && *p == CO_CANARY)
+            ++p;
+        size_t used = (size_t)((const char *)end - (const char *)p);
+        if (used > co->sthigh)
+            co->sthigh = used;
+    }
+    return co->sthigh;
+}
+
+#define STATS_INIT(SCH, CO) stats_init((SCH), (CO))
+#define STATS_SWITCH(FROM, TO, RESUMED) stats_switch((FROM), (TO), (RESUMED))
+#define STATS_STACK(SCH, CO) ((void)stack_high_water((SCH), (CO)))
+#else
+#define STATS_INIT(SCH, CO)
+#define STATS_SWITCH(FROM, TO, RESUMED)
+#define STATS_STACK(SCH, CO)
+#endif
+
+static scheduler *scheduler_create(size_t stsize, int shared) {
     scheduler *sch = (scheduler *)malloc(sizeof(scheduler));
     if (sch == NULL)
         return NULL;
+    sch->pgsize = (size_t)sysconf(_SC_PAGESIZE);
     sch->stsize = MIN(SCHEDULER_MAX_ST_SIZE, MAX(stsize, SCHEDULER_MIN_ST_SIZE));
+    sch->stsize = (sch->stsize + sch->pgsize - 1) & ~(sch->pgsize - 1);
+    sch->stpool = NULL;
+    sch->nstpool = 0;
     sch->nco = 0;
-    sch->cap = SCHEDULER_CO_SIZE;
-    sch->co = (coroutine **)calloc(sch->cap, sizeof(coroutine *));
-    if (sch->co == NULL) {
+    sch->cap = 0;
+    sch->co = NULL;
+    sch->freeco = -1;
+    sch->freetail = -1;
+    if (slots_grow(sch, SCHEDULER_CO_SIZE) != 0) {
+        free(sch->co);
         free(sch);
         return NULL;
     }
     sch->yd = NULL;
     sch->sd = NULL;
+    sch->shstack = NULL;
+    sch->showner = NULL;
+    sch->swstack = NULL;
+    sch->swto = NULL;
+    if (shared) {
+        sch->shstack = stack_map(sch, sch->stsize);
+        sch->swstack = stack_map(sch, SCHEDULER_SW_ST_SIZE);
+        if (sch->shstack == NULL || sch->swstack == NULL) {
+            if (sch->shstack != NULL)
+                stack_unmap(sch, sch->shstack, sch->stsize);
+            if (sch->swstack != NULL)
+                stack_unmap(sch, sch->swstack, SCHEDULER_SW_ST_SIZE);
+            free(sch->co[0]);
+            free(sch->co);
+            free(sch);
+            return NULL;
+        }
+        context_init(&sch->swctx, sch->swstack, SCHEDULER_SW_ST_SIZE, shstack_switcher, sch);
+    }
 
     // spawn main coroutine
     coroid_t mid = coroutine_new(sch, NULL, NULL);
     if (mid != MAIN_CO_ID)
         errx(1, "invalid scheduler creation");
     // set main coroutine to running
-    sch->co[mid]->status = CO_STATUS_RUNNING;
+    sch->co[CO_INDEX(mid)]->status = CO_STATUS_RUNNING;
     sch->running = mid;
     return sch;
 }
 
+scheduler *scheduler_open(size_t stsize) {
+    return scheduler_create(stsize, 0);
+}
+
+scheduler *scheduler_open_shared(size_t stsize) {
+    return scheduler_create(stsize, 1);
+}
+
 void scheduler_close(scheduler *sch) {
     if (sch->running != MAIN_CO_ID)
         errx(1, "invalid scheduler close");
 
-    for (int i = 0; i < sch->cap; ++i) {
+    for (size_t i = 0; i < sch->cap; ++i) {
         coroutine *co = sch->co[i];
-        if (co != NULL) {
-            free(co->stack);
-            free(co);
-        }
+        if (co->stack != NULL)
+            stack_unmap(sch, co->stack, sch->stsize);
+        free(co->stsave);
+    }
+    for (size_t i = 0; i < sch->cap; i = i == 0 ? SCHEDULER_CO_SIZE : i * 2)
+        free(sch->co[i]);
+    while (sch->stpool != NULL) {
+        char *next = *(char **)sch->stpool;
+        stack_unmap(sch, sch->stpool, sch->stsize);
+        sch->stpool = next;
+    }
+    if (sch->shstack != NULL) {
+        stack_unmap(sch, sch->shstack, sch->stsize);
+        stack_unmap(sch, sch->swstack, SCHEDULER_SW_ST_SIZE);
     }
     free(sch->co);
     free(sch);
 }
 
 static void cofunc(scheduler *sch) {
-    coroutine *co = sch->co[sch->running];
+    coroutine *co = CO_RUNNING(sch);
     // run coroutine
     co->func(sch, co->args);
-    // coroutine finished
+    // coroutine finished, the slot can be reused
     co->status = CO_STATUS_COMPLETED;
     --sch->nco;
+    free_push(sch, CO_INDEX(sch->running));
     // restore precious coroutine
-    coroutine *prevco = sch->co[co->prevco];
+    coroutine *prevco = sch->co[CO_INDEX(co->prevco)];
     prevco->status = CO_STATUS_RUNNING;
     sch->running = co->prevco;
-    ucontext_t _;
-    swapcontext(&_, &prevco->ctx);
+    STATS_SWITCH(co, prevco, 0);
+    co_switch(sch, co, prevco);
 }
 
 coroid_t coroutine_new(scheduler *sch, yieldable f, void *args) {
-    coroid_t id = -1;
-    if (sch->nco >= sch->cap) {
-        // max size reached, double
-        coroutine **newco = (coroutine **)
-            realloc(sch->co, sch->cap * 2 * sizeof(coroutine *));
-        if (newco == NULL)
-            return -1;
-        sch->co = newco;
-        memset(sch->co + sch->cap, 0, sch->cap * sizeof(coroutine *));
-        sch->cap *= 2;
-        id = sch->cap;
-    } else {
-        // find empty slot
-        for (coroid_t i = 0; i < sch->cap; ++i) {
-            if (sch->co[i] == NULL ||
-                sch->co[i]->status == CO_STATUS_COMPLETED) {
-                id = i;
-                break;
-            }
-        }
-    }
-    if (id < 0)
-        return id;
+    // take a free slot, or double the slots if there is none
+    if (sch->freeco < 0 && slots_grow(sch, sch->cap * 2) != 0)
+        return -1;
+    int index = sch->freeco;
+    coroutine *co = sch->co[index];
 
-    // create? coroutine
-    coroutine *co;
-    if (sch->co[id]) {
-        // reuse dead coroutine
-        co = sch->co[id];
-    } else {
-        // malloc new coroutine
-        co = (coroutine *)malloc(sizeof(coroutine));
-        if (co == NULL)
-            return -1;
-        if (id == MAIN_CO_ID) {
-            co->stack = NULL;
-        } else {
-            co->stack = (char *)malloc(sch->stsize);
-            if (co->stack == NULL) {
-                free(co);
-                return -1;
-            }
-        }
-        co->prevco = MAIN_CO_ID;
-        sch->co[id] = co;
-    }
+    // stacks of completed coroutines went back to the pool, so take one from there
+    char *stack = co->stack;
+    if (f != NULL && sch->shstack == NULL && stack == NULL && (stack = stack_alloc(sch)) == NULL)
+        return -1;
+    sch->freeco = co->nextfree;
+    if (sch->freeco < 0)
+        sch->freetail = -1;
+
+    // a reused slot gets a new generation so that old ids become invalid
+    if (co->status != CO_STATUS_NEXIST)
+        co->gen = (co->gen + 1) & CO_GEN_MASK;
+    coroid_t id = CO_ID(index, co->gen);
+    co->prevco = MAIN_CO_ID;
+    co->stack = stack;
+    co->stsavelen = 0;
+    co->fresh = 0;
+    if (sch->showner == co)
+        sch->showner = NULL;
 
     ++sch->nco;
 
@@ -140,27 +572,33 @@ coroid_t coroutine_new(scheduler *sch, yieldable f, void *args) {
     co->args = args;
     co->sch = sch;
     co->status = CO_STATUS_PENDING;
+    STATS_INIT(sch, co);
 
     if (f != NULL) {
-        coroutine *curco = sch->co[sch->running];
-        if (curco == NULL)
-            errx(1, "scheduler not valid");
-        getcontext(&co->ctx);
-        co->ctx.uc_stack.ss_sp = co->stack;
-        co->ctx.uc_stack.ss_size = sch->stsize;
-        co->ctx.uc_link = &curco->ctx;
-        makecontext(&co->ctx, (void(*)(void))cofunc, 1, sch);
+        // on the shared stack, the frame is built when the coroutine first runs
+        if (sch->shstack != NULL)
+            co->fresh = 1;
+        else
+            context_init(&co->ctx, co->stack, sch->stsize, cofunc, sch);
     }
 
     return id;
 }
 
-int coroutine_resume(scheduler *sch, coroid_t cid, void *send, void **yielded_r) {
-    if (cid < 0 || cid > sch->cap)
+// returns the coroutine of cid, or NULL if its slot has been reused
+static coroutine *co_lookup(scheduler *sch, coroid_t cid) {
+    if (cid < 0 || (size_t)CO_INDEX(cid) >= sch->cap)
         errx(1, "bad coroutine id");
-    coroutine *co = sch->co[cid],
-              *curco = sch->co[sch->running];
-    if (co == NULL || curco == NULL)
+    coroutine *co = sch->co[CO_INDEX(cid)];
+    if (co->gen != CO_GEN(cid) || co->status == CO_STATUS_NEXIST)
+        return NULL;
+    return co;
+}
+
+int coroutine_resume(scheduler *sch, coroid_t cid, void *send, void **yielded_r) {
+    coroutine *co = co_lookup(sch, cid),
+              *curco = CO_RUNNING(sch);
+    if (co == NULL)
         return -1;
     switch (co->status) {
         case CO_STATUS_PENDING:
@@ -171,7 +609,14 @@ int coroutine_resume(scheduler *sch, coroid_t cid, void *send, void **yielded_r)
 
             // send something to callee
             sch->sd = send;
-            swapcontext(&curco->ctx, &co->ctx);
+            STATS_SWITCH(curco, co, 1);
+            co_switch(sch, curco, co);
+            // a completed coroutine no longer runs on its stack
+            if (co->status == CO_STATUS_COMPLETED && co->stack != NULL) {
+                STATS_STACK(sch, co);
+                stack_release(sch, co->stack);
+                co->stack = NULL;
+            }
             // obtain the yielded xxx from switched-out coroutine
             if (yielded_r != NULL)
                 *yielded_r = sch->yd;
@@ -191,15 +636,16 @@ int coroutine_yield(scheduler *sch, void *result, void **received_r) {
     if (id < 0)
         errx(1, "bad coroutine id");
 
-    coroutine *co = sch->co[id],
-              *prevco = sch->co[co->prevco];
+    coroutine *co = sch->co[CO_INDEX(id)],
+              *prevco = sch->co[CO_INDEX(co->prevco)];
     co->status = CO_STATUS_PENDING;
     prevco->status = CO_STATUS_RUNNING;
     sch->running = co->prevco;
 
     // yield something to caller
     sch->yd = result;
-    swapcontext(&co->ctx, &prevco->ctx);
+    STATS_SWITCH(co, prevco, 0);
+    co_switch(sch, co, prevco);
     // obtain the sent result from the caller coroutine
     if (received_r != NULL)
         *received_r = sch->sd;
@@ -213,9 +659,53 @@ coroid_t coroutine_running(scheduler *sch) {
 }
 
 co_status coroutine_status(scheduler *sch, coroid_t cid) {
-    if (cid < 0 || cid > sch->cap)
-        errx(1, "bad coroutine id");
-    if (sch->co[cid] == NULL)
-        return CO_STATUS_NEXIST;
-    return sch->co[cid]->status;
+    coroutine *co = co_lookup(sch, cid);
+    return co == NULL ? CO_STATUS_NEXIST : co->status;
+}
+
+int coroutine_stats(scheduler *sch, coroid_t cid, co_stats *stats) {
+#ifdef CO_ENABLE_STATS
+    coroutine *co = co_lookup(sch, cid);
+    if (co == NULL)
+        return -1;
+    unsigned long long now = now_ns();
+    stats->resumes = co->resumes;
+    stats->run_ns = co->run_ns;
+    stats->pending_ns = co->pending_ns;
+    // count the interval in progress
+    if (co->status == CO_STATUS_RUNNING)
+        stats->run_ns += now - co->since;
+    else if (co->status == CO_STATUS_PENDING)
+        stats->pending_ns += now - co->since;
+    stats->stack_used = stack_high_water(sch, co);
+    stats->stack_size = co->func != NULL ? sch->stsize : 0;
+    return 0;
+#else
+    (void)sch;
+    (void)cid;
+    (void)stats;
+    return -1;
+#endif
+}
+
+void scheduler_dump_stats(scheduler *sch, FILE *f) {
+#ifdef CO_ENABLE_STATS
+    static const char *names[] = { "nonexistent", "completed", "pending", "running", "normal" };
+    fprintf(f, "%-10s %-10s %10s %14s %14s %10s %10s\n",
+        "id", "status", "resumes", "run_ns", "pending_ns", "stack", "stsize");
+    for (size_t i = 0; i < sch->cap; ++i) {
+        coroutine *co = sch->co[i];
+        if (co->status == CO_STATUS_NEXIST)
+            continue;
+        coroid_t cid = CO_ID((int)i, co->gen);
+        co_stats st;
+        coroutine_stats(sch, cid, &st);
+        fprintf(f, "%-10d %-10s %10llu %14llu %14llu %10zu %10zu\n",
+            cid, names[co->status], st.resumes, st.run_ns, st.pending_ns,
+            st.stack_used, st.stack_size);
+    }
+#else
+    (void)sch;
+    fprintf(f, "coroutine stats are disabled, build with CO_ENABLE_STATS\n");
+#endif
 }
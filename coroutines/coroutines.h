@@ -1,17 +1,39 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// contexts are switched by a hand-written register save/restore on x86-64 and
+// aarch64. if CO_USE_UCONTEXT is defined when building coroutines.c, or on other
+// architectures, glibc's swapcontext() is used instead
+
+// if CO_ENABLE_STATS is defined when building coroutines.c, every coroutine keeps
+// the counters of coroutine_stats(). this costs two clock reads per switch, and
+// the top CO_STATS_PAINT bytes (64 KiB unless defined) of private stacks are
+// painted when a coroutine is created, which commits that much of each stack
+
 #define SCHEDULER_MIN_ST_SIZE 128*1024
 #define SCHEDULER_MAX_ST_SIZE 1024*1024
+// stacks are mmap'ed with a guard page below them, so an overflow raises SIGSEGV.
+// at most this many stacks of completed coroutines are kept for reuse per scheduler
+#define SCHEDULER_ST_POOL_SIZE 64
+// stack size of the helper context that moves frames in shared stack mode
+#define SCHEDULER_SW_ST_SIZE 16*1024
 // default number of coroutines per scheduler before reallocating
 #define SCHEDULER_CO_SIZE 128
 // coroutine id of the main thread
 #define MAIN_CO_ID 0
+// the low bits of a coroutine id are its slot index, the rest is the generation of
+// the slot. an id whose slot has been reused by a newer coroutine is nonexistent,
+// and at most 1 << COROID_INDEX_BITS coroutines can exist at the same time.
+// generations have 31 - COROID_INDEX_BITS bits and wrap: freed slots are reused
+// oldest first, but once a slot has been reused 1 << (31 - COROID_INDEX_BITS) times,
+// an id kept from its first coroutine names the current one again
+#define COROID_INDEX_BITS 22
 
 typedef enum co_status {
     CO_STATUS_NEXIST,    // nonexistent
@@ -34,6 +56,12 @@ typedef int coroid_t;
 // NULL is returned if this fails
 scheduler *scheduler_open(size_t stsize);
 
+// like scheduler_open(), but all coroutines run on one shared stack of size stsize.
+// when a coroutine is switched out for another one, only the live part of its stack
+// is copied to a buffer of its own, so an idle coroutine costs a few hundred bytes.
+// pointers to locals of a coroutine must not be used by others while it is switched out
+scheduler *scheduler_open_shared(size_t stsize);
+
 // close the scheduler for the thread
 void scheduler_close(scheduler *sch);
 
@@ -56,6 +84,21 @@ coroid_t coroutine_running(scheduler *sch);
 
 co_status coroutine_status(scheduler *sch, coroid_t cid);
 
+typedef struct co_stats {
+    unsigned long long resumes;    // times it has been resumed
+    unsigned long long run_ns;     // time spent running, not counting coroutines it resumed
+    unsigned long long pending_ns; // time spent created or yielded, waiting for a resume
+    size_t stack_used;             // stack high-water mark in bytes, up to CO_STATS_PAINT
+    size_t stack_size;             // 0 for the main coroutine
+} co_stats;
+
+// fills stats for the coroutine; stats of a completed coroutine are kept until its id
+// is reused. negative code is returned if this fails or stats are not enabled
+int coroutine_stats(scheduler *sch, coroid_t cid, co_stats *stats);
+
+// prints the stats of every coroutine of the scheduler, one per line
+void scheduler_dump_stats(scheduler *sch, FILE *f);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,256 @@
+// requires -std=c++20
+// stackless tasks and generators that interoperate with the stackful coroutines
+// of coroutines.h
+#pragma once
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <stdexcept>
+#include <utility>
+#include <variant>
+
+#include "coroutines.h"
+
+namespace oneesama {
+
+    // Recycles coroutine frames by size class. Schedulers are per thread, so the pool
+    // of the thread serves every stackless coroutine started under its scheduler.
+    class frame_pool {
+    public:
+        static constexpr std::size_t granularity = 64;
+        static constexpr std::size_t nclasses = 16; // frames up to 1 KiB are pooled
+
+        frame_pool() = default;
+        frame_pool(const frame_pool &) = delete;
+        frame_pool &operator=(const frame_pool &) = delete;
+
+        ~frame_pool() {
+            for (auto &head : free_) {
+                while (head) {
+                    auto next = head->next;
+                    ::operator delete(head);
+                    head = next;
+                }
+            }
+        }
+
+        void *allocate(std::size_t size) {
+            auto c = size_class(size);
+            if (c >= nclasses) return ::operator new(size);
+            if (auto node = free_[c]) {
+                free_[c] = node->next;
+                return node;
+            }
+            return ::operator new((c + 1) * granularity);
+        }
+
+        void deallocate(void *p, std::size_t size) noexcept {
+            auto c = size_class(size);
+            if (c >= nclasses) return ::operator delete(p);
+            auto node = static_cast<free_node *>(p);
+            node->next = free_[c];
+            free_[c] = node;
+        }
+
+        static frame_pool &of_this_thread() {
+            static thread_local frame_pool pool;
+            return pool;
+        }
+
+    private:
+        struct free_node {
+            free_node *next;
+        };
+
+        free_node *free_[nclasses] {};
+
+        static constexpr std::size_t size_class(std::size_t size) {
+            return (size + granularity - 1) / granularity - 1;
+        }
+    };
+
+    namespace detail {
+        // frames of every stackless coroutine come from the frame pool
+        struct pooled_promise {
+            static void *operator new(std::size_t size) {
+                return frame_pool::of_this_thread().allocate(size);
+            }
+            static void operator delete(void *p, std::size_t size) noexcept {
+                frame_pool::of_this_thread().deallocate(p, size);
+            }
+        };
+
+        template<class T>
+        struct result_holder {
+            std::variant<std::monostate, T, std::exception_ptr> result;
+
+            template<class U>
+            void return_value(U &&v) { result.template emplace<1>(std::forward<U>(v)); }
+            void unhandled_exception() { result.template emplace<2>(std::current_exception()); }
+
+            T take() {
+                if (result.index() == 2) std::rethrow_exception(std::get<2>(result));
+                return std::move(std::get<1>(result));
+            }
+        };
+
+        template<>
+        struct result_holder<void> {
+            std::exception_ptr error;
+
+            void return_void() {}
+            void unhandled_exception() { error = std::current_exception(); }
+
+            void take() {
+                if (error) std::rethrow_exception(error);
+            }
+        };
+    }
+
+    // A lazily started stackless coroutine producing a T. co_await it from another task,
+    // or run it from a stackful coroutine with await_in().
+    template<class T = void>
+    class task {
+    public:
+        struct promise_type : detail::pooled_promise, detail::result_holder<T> {
+            std::coroutine_handle<> continuation {std::noop_coroutine()};
+
+            task get_return_object() {
+                return task{std::coroutine_handle<promise_type>::from_promise(*this)};
+            }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            // continue the awaiting coroutine without growing the stack
+            auto final_suspend() noexcept {
+                struct final_awaiter {
+                    bool await_ready() noexcept { return false; }
+                    std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept {
+                        return h.promise().continuation;
+                    }
+                    void await_resume() noexcept {}
+                };
+                return final_awaiter{};
+            }
+        };
+
+        task(task &&o) noexcept : h_{std::exchange(o.h_, nullptr)} {}
+        task &operator=(task o) noexcept {
+            std::swap(h_, o.h_);
+            return *this;
+        }
+        ~task() { if (h_) h_.destroy(); }
+
+        bool done() const { return !h_ || h_.done(); }
+
+        auto operator co_await() && noexcept {
+            struct awaiter {
+                std::coroutine_handle<promise_type> h;
+                bool await_ready() noexcept { return h.done(); }
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<> cont) noexcept {
+                    h.promise().continuation = cont;
+                    return h;
+                }
+                T await_resume() { return h.promise().take(); }
+            };
+            return awaiter{h_};
+        }
+
+        // Runs the task inside the stackful coroutine that is running in sch. If the task
+        // suspends on something that is completed elsewhere, the stackful coroutine yields
+        // to its resumer until the task is done.
+        friend T await_in(scheduler *sch, task t) {
+            t.h_.resume();
+            while (!t.h_.done()) {
+                if (coroutine_yield(sch, nullptr, nullptr) < 0)
+                    throw std::runtime_error{"cannot wait for a task in the main coroutine"};
+            }
+            return t.h_.promise().take();
+        }
+
+    private:
+        explicit task(std::coroutine_handle<promise_type> h) : h_{h} {}
+
+        std::coroutine_handle<promise_type> h_;
+    };
+
+    // A stackless generator: each next() is a direct resume of its frame, no context switch.
+    template<class T>
+    class generator {
+    public:
+        struct promise_type : detail::pooled_promise {
+            T *current {};
+            std::exception_ptr error;
+
+            generator get_return_object() {
+                return generator{std::coroutine_handle<promise_type>::from_promise(*this)};
+            }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            std::suspend_always final_suspend() noexcept { return {}; }
+            std::suspend_always yield_value(T &v) noexcept {
+                current = &v;
+                return {};
+            }
+            std::suspend_always yield_value(T &&v) noexcept {
+                current = &v;
+                return {};
+            }
+            void return_void() {}
+            void unhandled_exception() { error = std::current_exception(); }
+        };
+
+        generator(generator &&o) noexcept : h_{std::exchange(o.h_, nullptr)} {}
+        generator &operator=(generator o) noexcept {
+            std::swap(h_, o.h_);
+            return *this;
+        }
+        ~generator() { if (h_) h_.destroy(); }
+
+        // advances to the next value and returns a pointer to it, or nullptr when finished
+        T *next() {
+            if (!h_ || h_.done()) return nullptr;
+            h_.resume();
+            if (h_.promise().error) std::rethrow_exception(std::exchange(h_.promise().error, nullptr));
+            return h_.done() ? nullptr : h_.promise().current;
+        }
+
+    private:
+        explicit generator(std::coroutine_handle<promise_type> h) : h_{h} {}
+
+        std::coroutine_handle<promise_type> h_;
+    };
+
+    // co_await resume_stackful{sch, cid, send} in a task resumes the stackful coroutine cid
+    // and gives the value it yields. the task keeps running on the stack of its resumer,
+    // so this is a plain coroutine_resume() and never suspends the task itself
+    struct resume_stackful {
+        scheduler *sch;
+        coroid_t cid;
+        void *send {};
+
+        bool await_ready() const noexcept { return true; }
+        void await_suspend(std::coroutine_handle<>) const noexcept {}
+        void *await_resume() const {
+            void *yielded;
+            if (coroutine_resume(sch, cid, send, &yielded) < 0)
+                throw std::runtime_error{"cannot resume stackful coroutine"};
+            return yielded;
+        }
+    };
+
+    // co_await yield_stackful{sch, result} in a task that runs inside a stackful coroutine
+    // yields that whole coroutine to its resumer, and gives the value sent back on resume
+    struct yield_stackful {
+        scheduler *sch;
+        void *result {};
+
+        bool await_ready() const noexcept { return true; }
+        void await_suspend(std::coroutine_handle<>) const noexcept {}
+        void *await_resume() const {
+            void *received;
+            if (coroutine_yield(sch, result, &received) < 0)
+                throw std::runtime_error{"cannot yield the main coroutine"};
+            return received;
+        }
+    };
+}
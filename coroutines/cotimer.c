@@ -0,0 +1,157 @@
+#include <stdbool.h>
+
+#include "cotimer.h"
+
+#define SLOT_MASK (COWHEEL_SLOTS - 1)
+#define LEVEL_SHIFT(L) ((L) * COWHEEL_SLOT_BITS)
+
+static inline void mark_used(cowheel *w, int level, int slot) {
+    w->used[level][slot / 64] |= (uint64_t)1 << (slot % 64);
+}
+
+static inline void mark_unused(cowheel *w, int level, int slot) {
+    w->used[level][slot / 64] &= ~((uint64_t)1 << (slot % 64));
+}
+
+// returns the first nonempty slot of level in [from, COWHEEL_SLOTS), or -1
+static int first_used(cowheel *w, int level, int from) {
+    for (int i = from / 64; i < COWHEEL_SLOTS / 64; ++i) {
+        uint64_t bits = w->used[level][i];
+        if (i == from / 64)
+            bits &= ~(uint64_t)0 << (from % 64);
+        if (bits)
+            return i * 64 + __builtin_ctzll(bits);
+    }
+    return -1;
+}
+
+void cowheel_init(cowheel *w, uint64_t now) {
+    w->now = now;
+    w->ntimers = 0;
+    w->firing = 0;
+    for (int l = 0; l < COWHEEL_LEVELS; ++l) {
+        for (int i = 0; i < COWHEEL_SLOTS; ++i)
+            w->slots[l][i].prev = w->slots[l][i].next = &w->slots[l][i];
+        for (int i = 0; i < COWHEEL_SLOTS / 64; ++i)
+            w->used[l][i] = 0;
+    }
+}
+
+// a timer goes to the level of the highest slot-sized digit in which its expiry
+// differs from now, so every timer of a level l slot shares the digits above l
+// with now, and the slot is moved down when the wheel reaches its first tick
+static void place(cowheel *w, cotimer *t) {
+    uint64_t diff = t->expires ^ w->now;
+    int level = 0;
+    if (diff >> COWHEEL_SLOT_BITS)
+        level = (63 - __builtin_clzll(diff)) / COWHEEL_SLOT_BITS;
+    if (level >= COWHEEL_LEVELS)
+        level = COWHEEL_LEVELS - 1;
+    int slot = (int)(t->expires >> LEVEL_SHIFT(level)) & SLOT_MASK;
+    cotimer *head = &w->slots[level][slot];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+    t->level = level;
+    t->slot = slot;
+    mark_used(w, level, slot);
+}
+
+static void unlink_timer(cowheel *w, cotimer *t) {
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    cotimer *head = &w->slots[t->level][t->slot];
+    if (head->next == head)
+        mark_unused(w, t->level, t->slot);
+}
+
+void cotimer_start(cowheel *w, cotimer *t, uint64_t ticks, cotimer_cb cb, void *arg) {
+    if (ticks == 0)
+        ticks = 1;
+    if (ticks > COWHEEL_MAX_DELAY)
+        ticks = COWHEEL_MAX_DELAY;
+    t->expires = w->now + ticks;
+    t->cb = cb;
+    t->arg = arg;
+    t->pending = 1;
+    place(w, t);
+    ++w->ntimers;
+}
+
+void cotimer_cancel(cowheel *w, cotimer *t) {
+    if (!t->pending)
+        return;
+    unlink_timer(w, t);
+    t->pending = 0;
+    --w->ntimers;
+}
+
+// returns the next tick after now at which a timer fires or a slot has to be
+// moved down, or UINT64_MAX if there are no timers
+static uint64_t next_event(cowheel *w) {
+    uint64_t best = UINT64_MAX;
+    for (int l = 0; l < COWHEEL_LEVELS; ++l) {
+        int shift = LEVEL_SHIFT(l);
+        int cur = (int)(w->now >> shift) & SLOT_MASK;
+        uint64_t base = w->now >> (shift + COWHEEL_SLOT_BITS) << (shift + COWHEEL_SLOT_BITS);
+        int slot = first_used(w, l, cur + 1);
+        if (slot < 0 && l == COWHEEL_LEVELS - 1) {
+            // the top level wraps around
+            slot = first_used(w, l, 0);
+            base += (uint64_t)1 << (shift + COWHEEL_SLOT_BITS);
+        }
+        if (slot < 0)
+            continue;
+        uint64_t tick = base | ((uint64_t)slot << shift);
+        if (tick < best)
+            best = tick;
+    }
+    return best;
+}
+
+uint64_t cowheel_next(cowheel *w) {
+    if (w->ntimers == 0)
+        return UINT64_MAX;
+    return next_event(w) - w->now;
+}
+
+size_t cowheel_advance(cowheel *w, uint64_t now) {
+    if (w->firing)
+        return 0;
+    w->firing = 1;
+    size_t nfired = 0;
+    while (w->now < now) {
+        uint64_t tick = w->ntimers ? next_event(w) : UINT64_MAX;
+        if (tick > now) {
+            // nothing happens in between
+            w->now = now;
+            break;
+        }
+        w->now = tick;
+        // move down the slots that start at this tick, highest level first
+        for (int l = COWHEEL_LEVELS - 1; l > 0; --l) {
+            int shift = LEVEL_SHIFT(l);
+            if (tick & (((uint64_t)1 << shift) - 1))
+                continue;
+            cotimer *head = &w->slots[l][(tick >> shift) & SLOT_MASK];
+            while (head->next != head) {
+                cotimer *t = head->next;
+                unlink_timer(w, t);
+                place(w, t);
+            }
+        }
+        // fire; callbacks might add or remove timers, so take one at a time
+        cotimer *head = &w->slots[0][tick & SLOT_MASK];
+        while (head->next != head) {
+            cotimer *t = head->next;
+            unlink_timer(w, t);
+            t->pending = 0;
+            --w->ntimers;
+            ++nfired;
+            t->cb(t, t->arg);
+        }
+    }
+    w->firing = 0;
+    return nfired;
+}
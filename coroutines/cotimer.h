@@ -0,0 +1,67 @@
+// a hierarchical timing wheel. timers are intrusive, so starting and cancelling
+// one never allocates and takes constant time
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 4 levels of 256 slots; a level covers 256 times the ticks of the level below
+#define COWHEEL_LEVELS 4
+#define COWHEEL_SLOT_BITS 8
+#define COWHEEL_SLOTS (1 << COWHEEL_SLOT_BITS)
+// timers further away than this are clamped. one slot of the top level is kept
+// free so that a timer never lands in the slot the wheel is at
+#define COWHEEL_MAX_DELAY (((uint64_t)1 << (COWHEEL_LEVELS * COWHEEL_SLOT_BITS)) - \
+                           ((uint64_t)1 << ((COWHEEL_LEVELS - 1) * COWHEEL_SLOT_BITS)))
+
+struct cotimer;
+typedef void (*cotimer_cb)(struct cotimer *t, void *arg);
+
+// a timer. behaviour is undefined if these fields are written
+typedef struct cotimer {
+    struct cotimer *prev;
+    struct cotimer *next;
+    uint64_t expires;   // tick to fire at
+    cotimer_cb cb;
+    void *arg;
+    int pending;        // linked in the wheel
+    int level;          // position in the wheel if pending
+    int slot;
+} cotimer;
+
+typedef struct cowheel {
+    uint64_t now;       // current tick; everything before has fired
+    size_t ntimers;     // pending timers
+    int firing;         // cowheel_advance() is calling callbacks
+    cotimer slots[COWHEEL_LEVELS][COWHEEL_SLOTS];  // list heads
+    uint64_t used[COWHEEL_LEVELS][COWHEEL_SLOTS / 64]; // bitmap of nonempty slots
+} cowheel;
+
+// initializes an empty wheel whose current tick is now
+void cowheel_init(cowheel *w, uint64_t now);
+
+// starts t so that cb(t, arg) is called when the wheel is advanced past `ticks` ticks
+// from now, at least 1. t must not be pending
+void cotimer_start(cowheel *w, cotimer *t, uint64_t ticks, cotimer_cb cb, void *arg);
+
+// stops t if it is pending
+void cotimer_cancel(cowheel *w, cotimer *t);
+
+// returns the number of ticks from now until the wheel has to be advanced next,
+// or UINT64_MAX if there are no timers. it might be earlier than the first expiry
+// when timers have to be moved down to a lower level
+uint64_t cowheel_next(cowheel *w);
+
+// moves the wheel to tick now, calling the callbacks of expired timers in order.
+// callbacks can start and cancel timers, which are then relative to the tick being
+// fired. calling this from a callback does nothing, so that later ticks never fire
+// before the rest of the current one. returns the number of fired timers
+size_t cowheel_advance(cowheel *w, uint64_t now);
+
+#ifdef __cplusplus
+}
+#endif
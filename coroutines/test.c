@@ -1,9 +1,130 @@
+// checks of the library, then a demo that echoes lines read from stdin
+// build: cc -O2 -pthread *.c -o test
+// add -DCO_USE_UCONTEXT to check the swapcontext() switch instead of the assembly one,
+// and -DCO_ENABLE_STATS to check the stats too
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "cochan.h"
+#include "coio.h"
+#include "copool.h"
 #include "coroutines.h"
+#include "cotimer.h"
 
-static void send(scheduler *sch, void *args) {
+// stops the tests at the first failed check
+#define CHECK(COND) do { \
+        if (!(COND)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #COND); \
+            exit(1); \
+        } \
+    } while (0)
+
+// yields back twice every value it is sent, starting with its argument, until it
+// is sent 0
+static void doubler(scheduler *sch, void *args) {
+    long n = (long)args;
+    while (n != 0) {
+        void *got;
+        CHECK(coroutine_yield(sch, (void *)(n * 2), &got) == 0);
+        n = (long)got;
+    }
+}
+
+// sums 1..depth with a frame per number, yielding on the way down every 64 frames
+static long deep_sum(scheduler *sch, int depth) {
+    volatile char pad[64];
+    pad[0] = (char)depth;
+    if (depth == 0)
+        return 0;
+    if (depth % 64 == 0)
+        coroutine_yield(sch, (void *)(long)depth, NULL);
+    return depth + deep_sum(sch, depth - 1) + pad[0] - (char)depth;
+}
+
+static void deep(scheduler *sch, void *args) {
+    long depth = (long)args;
+    coroutine_yield(sch, (void *)deep_sum(sch, (int)depth), NULL);
+}
+
+// read through volatile, so that nothing can be recomputed after a switch
+static volatile long seed[9] = { 101, -202, 303, -404, 505, -606, 707, -808, 909 };
+
+// keeps many integers and doubles live across a yield, so that some of them sit in
+// callee-saved registers while other code runs
+__attribute__((noinline))
+static void live_values(scheduler *sch) {
+    long a = seed[0], b = seed[1], c = seed[2], d = seed[3], e = seed[4], f = seed[5];
+    double x = (double)seed[6] / 7, y = (double)seed[7] / 9, z = (double)seed[8] / 11;
+    coroutine_yield(sch, NULL, NULL);
+    CHECK(a == seed[0] && b == seed[1] && c == seed[2] && d == seed[3] && e == seed[4] && f == seed[5]);
+    CHECK(x == (double)seed[6] / 7 && y == (double)seed[7] / 9 && z == (double)seed[8] / 11);
+}
+
+static void live(scheduler *sch, void *args) {
+    (void)args;
+    live_values(sch);
+}
+
+// fills the callee-saved registers with other values between the switches of
+// live(), by keeping its own values live across its yields. the scheduler is read
+// from memory too, so that no register holds the same pointer in both
+static scheduler *volatile clobber_sch;
+
+static void clobber(scheduler *sch, void *args) {
+    (void)args;
+    clobber_sch = sch;
+    for (;;) {
+        long a = -seed[5], b = -seed[4], c = -seed[3], d = -seed[2], e = -seed[1], f = -seed[0];
+        double x = (double)seed[0] * 3, y = (double)seed[1] * 5, z = (double)seed[2] * 7;
+        coroutine_yield(clobber_sch, NULL, NULL);
+        CHECK(a + b + c + d + e + f == -(seed[0] + seed[1] + seed[2] + seed[3] + seed[4] + seed[5]));
+        CHECK(x + y + z == (double)seed[0] * 3 + (double)seed[1] * 5 + (double)seed[2] * 7);
+    }
+}
+
+static void check_switch(void) {
+    scheduler *sch = scheduler_open(512 * 1024);
+    CHECK(sch != NULL);
+
+    // values go both ways through resume and yield
+    coroid_t id = coroutine_new(sch, doubler, (void *)21L);
+    void *got;
+    CHECK(coroutine_resume(sch, id, NULL, &got) == 0 && (long)got == 42);
+    for (long n = 1; n < 100; ++n)
+        CHECK(coroutine_resume(sch, id, (void *)n, &got) == 0 && (long)got == 2 * n);
+    CHECK(coroutine_resume(sch, id, NULL, &got) == 0 && got == NULL);
+    CHECK(coroutine_status(sch, id) == CO_STATUS_COMPLETED);
+    CHECK(coroutine_resume(sch, id, NULL, NULL) < 0);
+    CHECK(coroutine_yield(sch, NULL, NULL) < 0);
+
+    // deep frames survive the switches
+    id = coroutine_new(sch, deep, (void *)2000L);
+    for (long depth = 1984; depth > 0; depth -= 64)
+        CHECK(coroutine_resume(sch, id, NULL, &got) == 0 && (long)got == depth);
+    CHECK(coroutine_resume(sch, id, NULL, &got) == 0 && (long)got == 2000L * 2001 / 2);
+
+    // registers are restored after other code used them
+    id = coroutine_new(sch, live, NULL);
+    coroid_t other = coroutine_new(sch, clobber, NULL);
+    CHECK(coroutine_resume(sch, id, NULL, NULL) == 0);
+    CHECK(coroutine_resume(sch, other, NULL, NULL) == 0);
+    double kept = (double)seed[0] / 3;
+    CHECK(coroutine_resume(sch, other, NULL, NULL) == 0);
+    CHECK(kept == (double)seed[0] / 3);
+    CHECK(coroutine_resume(sch, id, NULL, NULL) == 0);
+    CHECK(coroutine_status(sch, id) == CO_STATUS_COMPLETED);
+    scheduler_close(sch);
+}
+
+static void send_lines(scheduler *sch, void *args) {
     (void)args;
     for (;;) {
         char *buff = (char *)malloc(256);
@@ -32,9 +153,448 @@ static void receive(scheduler *sch, void *args) {
     printf("bye!\n");
 }
 
+// fills a local array from its argument and checks it after every yield, while the
+// other coroutines of the shared stack run in between and their frames are copied
+// in and out
+static void stack_owner(scheduler *sch, void *args) {
+    long id = (long)args;
+    long locals[300];
+    for (int i = 0; i < 300; ++i)
+        locals[i] = id * 1000 + i;
+    double half = (double)id / 2;
+    for (int round = 0; round < 50; ++round) {
+        // a deeper frame on some rounds, so the saved part changes size
+        if (round % 3 == 0)
+            CHECK(deep_sum(sch, 64 * (int)id) == 64 * id * (64 * id + 1) / 2);
+        coroutine_yield(sch, (void *)id, NULL);
+        for (int i = 0; i < 300; ++i)
+            CHECK(locals[i] == id * 1000 + i);
+        CHECK(half == (double)id / 2);
+    }
+}
+
+static void check_shared_stack(void) {
+    scheduler *sch = scheduler_open_shared(256 * 1024);
+    CHECK(sch != NULL);
+    enum { N = 5 };
+    coroid_t ids[N];
+    for (long i = 0; i < N; ++i)
+        ids[i] = coroutine_new(sch, stack_owner, (void *)(i + 1));
+    // round robin until all are done; deep_sum() yields its depth on the way down
+    int left = N;
+    while (left > 0) {
+        left = 0;
+        for (int i = 0; i < N; ++i) {
+            if (coroutine_status(sch, ids[i]) == CO_STATUS_COMPLETED)
+                continue;
+            ++left;
+            CHECK(coroutine_resume(sch, ids[i], NULL, NULL) == 0);
+        }
+    }
+    scheduler_close(sch);
+}
+
+// yields its argument once, then completes
+static void echo_once(scheduler *sch, void *args) {
+    coroutine_yield(sch, args, NULL);
+}
+
+// ids of completed coroutines must not reach the coroutine that reuses their slot,
+// and growing the slots must keep the ids that exist
+static void check_ids(void) {
+    scheduler *sch = scheduler_open(0);
+    CHECK(sch != NULL);
+    coroid_t done = coroutine_new(sch, echo_once, NULL);
+    CHECK(coroutine_resume(sch, done, NULL, NULL) == 0);
+    CHECK(coroutine_resume(sch, done, NULL, NULL) == 0);
+    CHECK(coroutine_status(sch, done) == CO_STATUS_COMPLETED);
+
+    // past 128, 256 and 512 slots; the slot of done is reused on the way
+    enum { N = 600 };
+    static coroid_t ids[N];
+    for (long i = 0; i < N; ++i) {
+        ids[i] = coroutine_new(sch, echo_once, (void *)i);
+        CHECK(ids[i] >= 0 && ids[i] != done);
+        for (long j = 0; j <= i; j += 97)
+            CHECK(coroutine_status(sch, ids[j]) == CO_STATUS_PENDING);
+    }
+    CHECK(coroutine_status(sch, done) == CO_STATUS_NEXIST);
+    CHECK(coroutine_resume(sch, done, NULL, NULL) < 0);
+    for (long i = 0; i < N; ++i) {
+        void *got;
+        CHECK(coroutine_resume(sch, ids[i], NULL, &got) == 0 && (long)got == i);
+        CHECK(coroutine_resume(sch, ids[i], NULL, NULL) == 0);
+        CHECK(coroutine_status(sch, ids[i]) == CO_STATUS_COMPLETED);
+    }
+    scheduler_close(sch);
+}
+
+static copool *test_pool;
+static atomic_int pool_count;
+
+// counts itself after a few yields
+static void pool_counter(scheduler *sch, void *args) {
+    (void)args;
+    for (int i = 0; i < 3; ++i)
+        coroutine_yield(sch, NULL, NULL);
+    atomic_fetch_add(&pool_count, 1);
+}
+
+// sleeps, blocking its worker, and records the thread it ran on
+static void pool_sleeper(scheduler *sch, void *args) {
+    (void)sch;
+    usleep(1000);
+    *(pthread_t *)args = pthread_self();
+}
+
+// spawns children into its own worker, and joins them from inside the pool
+static void pool_parent(scheduler *sch, void *args) {
+    (void)sch;
+    pthread_t *threads = (pthread_t *)args;
+    cotask *tasks[64];
+    for (int i = 0; i < 64; ++i)
+        CHECK((tasks[i] = copool_spawn(test_pool, pool_sleeper, &threads[i])) != NULL);
+    for (int i = 0; i < 64; ++i)
+        CHECK(copool_join(test_pool, tasks[i]) == 0);
+}
+
+static void pool_long_sleeper(scheduler *sch, void *args) {
+    (void)sch;
+    (void)args;
+    usleep(200000);
+}
+
+// joins a task of another worker; the worker must sleep meanwhile
+static void pool_joiner(scheduler *sch, void *args) {
+    (void)sch;
+    CHECK(copool_join(test_pool, (cotask *)args) == 0);
+}
+
+static void check_pool(void) {
+    test_pool = copool_open(4, 0);
+    CHECK(test_pool != NULL);
+
+    // spawned and joined from outside
+    cotask *tasks[200];
+    for (int i = 0; i < 200; ++i)
+        CHECK((tasks[i] = copool_spawn(test_pool, pool_counter, NULL)) != NULL);
+    for (int i = 0; i < 200; ++i)
+        CHECK(copool_join(test_pool, tasks[i]) == 0);
+    CHECK(atomic_load(&pool_count) == 200);
+
+    // joined from inside; idle workers steal children from the parent's worker
+    static pthread_t threads[64];
+    cotask *parent = copool_spawn(test_pool, pool_parent, threads);
+    CHECK(parent != NULL && copool_join(test_pool, parent) == 0);
+    int others = 0;
+    for (int i = 1; i < 64; ++i)
+        others += !pthread_equal(threads[i], threads[0]);
+    CHECK(others > 0);
+
+    // a joiner parks instead of spinning while the joined task sleeps elsewhere
+    cotask *sleeper = copool_spawn(test_pool, pool_long_sleeper, NULL);
+    usleep(20000);
+    clock_t cpu = clock();
+    cotask *joiner = copool_spawn(test_pool, pool_joiner, sleeper);
+    CHECK(joiner != NULL && copool_join(test_pool, joiner) == 0);
+    CHECK(clock() - cpu < CLOCKS_PER_SEC / 10);
+
+    // detached tasks still run before the pool closes
+    atomic_store(&pool_count, 0);
+    for (int i = 0; i < 100; ++i) {
+        cotask *t = copool_spawn(test_pool, pool_counter, NULL);
+        CHECK(t != NULL);
+        copool_detach(test_pool, t);
+    }
+    copool_close(test_pool);
+    CHECK(atomic_load(&pool_count) == 100);
+}
+
+static void check_stats(void) {
+    scheduler *sch = scheduler_open(512 * 1024);
+    CHECK(sch != NULL);
+    co_stats st;
+    if (coroutine_stats(sch, MAIN_CO_ID, &st) < 0) {
+        scheduler_close(sch);
+        return;
+    }
+    CHECK(st.stack_size == 0);
+
+    // 200 frames of at least 64 bytes, yielding at 192, 128 and 64 and then the sum
+    coroid_t d = coroutine_new(sch, deep, (void *)200L);
+    coroid_t e = coroutine_new(sch, echo_once, NULL);
+    for (int i = 0; i < 5; ++i)
+        CHECK(coroutine_resume(sch, d, NULL, NULL) == 0);
+    CHECK(coroutine_resume(sch, e, NULL, NULL) == 0);
+    CHECK(coroutine_resume(sch, e, NULL, NULL) == 0);
+    CHECK(coroutine_status(sch, d) == CO_STATUS_COMPLETED);
+    CHECK(coroutine_stats(sch, d, &st) == 0);
+    CHECK(st.resumes == 5 && st.run_ns > 0 && st.pending_ns > 0);
+    CHECK(st.stack_size == 512 * 1024);
+    size_t deep_used = st.stack_used;
+    CHECK(deep_used >= 200 * 64 && deep_used < 64 * 1024);
+    CHECK(coroutine_stats(sch, e, &st) == 0);
+    CHECK(st.resumes == 2 && st.stack_used > 0 && st.stack_used < deep_used / 2);
+
+    // only the top 64 KiB are painted, deeper use counts as all of it
+    coroid_t far = coroutine_new(sch, deep, (void *)2000L);
+    while (coroutine_status(sch, far) != CO_STATUS_COMPLETED)
+        CHECK(coroutine_resume(sch, far, NULL, NULL) == 0);
+    CHECK(coroutine_stats(sch, far, &st) == 0);
+    CHECK(st.stack_used > 63 * 1024 && st.stack_used <= 64 * 1024);
+    scheduler_close(sch);
+}
+
+// more than a socket buffer holds, so the writer has to wait for the reader
+#define IO_BYTES (4 << 20)
+
+static coreactor *io_reactor;
+static int io_fds[4];
+
+static void io_writer(scheduler *sch, void *args) {
+    (void)sch, (void)args;
+    static char buf[65536];
+    size_t off = 0;
+    while (off < IO_BYTES) {
+        for (size_t i = 0; i < sizeof buf; ++i)
+            buf[i] = (char)((off + i) * 7);
+        size_t done = 0;
+        while (done < sizeof buf) {
+            ssize_t n = co_write(io_reactor, io_fds[0], buf + done, sizeof buf - done);
+            CHECK(n > 0);
+            done += (size_t)n;
+        }
+        off += sizeof buf;
+    }
+    CHECK(close(io_fds[0]) == 0);
+}
+
+static void io_reader(scheduler *sch, void *args) {
+    (void)sch;
+    size_t *got = args;
+    char buf[4096];
+    ssize_t n;
+    while ((n = co_read(io_reactor, io_fds[1], buf, sizeof buf)) > 0) {
+        for (ssize_t i = 0; i < n; ++i)
+            CHECK(buf[i] == (char)((*got + (size_t)i) * 7));
+        *got += (size_t)n;
+    }
+    CHECK(n == 0);
+}
+
+static void io_idle_reader(scheduler *sch, void *args) {
+    (void)sch, (void)args;
+    char c;
+    CHECK(co_read_timed(io_reactor, io_fds[3], &c, 1, 50) == -1 && errno == ETIMEDOUT);
+}
+
+static long elapsed_ms(const struct timespec *since) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void check_io(void) {
+    scheduler *sch = scheduler_open(0);
+    CHECK(sch != NULL && (io_reactor = coreactor_open(sch)) != NULL);
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, io_fds) == 0);
+    CHECK(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, io_fds + 2) == 0);
+
+    // the reader waits for data first, then the writer waits for the reader
+    size_t got = 0;
+    coroid_t reader = coroutine_new(sch, io_reader, &got);
+    coroid_t writer = coroutine_new(sch, io_writer, NULL);
+    CHECK(coroutine_resume(sch, reader, NULL, NULL) == 0);
+    CHECK(coreactor_nwaiting(io_reactor) == 1);
+    CHECK(coroutine_resume(sch, writer, NULL, NULL) == 0);
+    CHECK(coroutine_status(sch, writer) == CO_STATUS_PENDING);
+    CHECK(coreactor_nwaiting(io_reactor) == 2);
+    while (coroutine_status(sch, reader) != CO_STATUS_COMPLETED)
+        CHECK(coreactor_run(io_reactor, 1000) > 0);
+    CHECK(coroutine_status(sch, writer) == CO_STATUS_COMPLETED);
+    CHECK(got == IO_BYTES && coreactor_nwaiting(io_reactor) == 0);
+
+    // nothing is ever written to io_fds[3]
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    coroid_t idle = coroutine_new(sch, io_idle_reader, NULL);
+    CHECK(coroutine_resume(sch, idle, NULL, NULL) == 0);
+    CHECK(coreactor_ntimeouts(io_reactor) == 1);
+    while (coroutine_status(sch, idle) != CO_STATUS_COMPLETED)
+        CHECK(coreactor_run(io_reactor, 1000) >= 0);
+    // the wheel ticks in whole milliseconds, so it can fire up to one early
+    CHECK(elapsed_ms(&start) >= 49);
+    CHECK(coreactor_nwaiting(io_reactor) == 0 && coreactor_ntimeouts(io_reactor) == 0);
+
+    close(io_fds[1]);
+    close(io_fds[2]);
+    close(io_fds[3]);
+    coreactor_close(io_reactor);
+    scheduler_close(sch);
+}
+
+// sends 1 to 100, then closes the channel
+static void chan_producer(scheduler *sch, void *args) {
+    (void)sch;
+    chan *ch = args;
+    for (int i = 1; i <= 100; ++i)
+        CHECK(chan_send(ch, &i) == 0);
+    chan_close(ch);
+}
+
+struct consumed {
+    chan *ch;
+    int n;
+    int got[100];
+};
+
+static void chan_consumer(scheduler *sch, void *args) {
+    (void)sch;
+    struct consumed *c = args;
+    int v;
+    while (chan_recv(c->ch, &v) == 0) {
+        CHECK(c->n < 100);
+        c->got[c->n++] = v;
+    }
+}
+
+// waits on a channel nobody sends to, or on a full one
+static void chan_stuck(scheduler *sch, void *args) {
+    (void)sch;
+    chan *ch = args;
+    int v = 0;
+    if (chan_len(ch) == 0)
+        CHECK(chan_recv(ch, &v) < 0);
+    else
+        CHECK(chan_send(ch, &v) < 0);
+}
+
+static void check_chan_on(scheduler *sch) {
+    size_t caps[] = { 0, 1, 7, 200 };
+    for (size_t k = 0; k < sizeof caps / sizeof *caps; ++k) {
+        chan *ch = CHAN_OPEN(sch, int, caps[k]);
+        CHECK(ch != NULL);
+        struct consumed c = { ch, 0, { 0 } };
+        coroid_t p = coroutine_new(sch, chan_producer, ch);
+        coroid_t r = coroutine_new(sch, chan_consumer, &c);
+        // the producer fills the buffer and waits until the consumer wakes it
+        CHECK(coroutine_resume(sch, p, NULL, NULL) == 0);
+        if (caps[k] < 100) {
+            CHECK(coroutine_status(sch, p) == CO_STATUS_PENDING);
+            CHECK(chan_len(ch) == caps[k]);
+            // the main coroutine is refused instead of waiting
+            int v = 0;
+            CHECK(chan_send(ch, &v) < 0);
+        }
+        CHECK(coroutine_resume(sch, r, NULL, NULL) == 0);
+        CHECK(coroutine_status(sch, p) == CO_STATUS_COMPLETED);
+        CHECK(coroutine_status(sch, r) == CO_STATUS_COMPLETED);
+        CHECK(c.n == 100);
+        for (int i = 0; i < 100; ++i)
+            CHECK(c.got[i] == i + 1);
+        chan_free(ch);
+    }
+
+    // closing resumes the waiting receivers, and the senders of a full channel
+    chan *empty = CHAN_OPEN(sch, int, 0), *full = CHAN_OPEN(sch, int, 1);
+    CHECK(empty != NULL && full != NULL);
+    int one = 1;
+    CHECK(chan_send(full, &one) == 0);
+    coroid_t stuck[4];
+    for (int i = 0; i < 4; ++i) {
+        stuck[i] = coroutine_new(sch, chan_stuck, i % 2 ? full : empty);
+        CHECK(coroutine_resume(sch, stuck[i], NULL, NULL) == 0);
+        CHECK(coroutine_status(sch, stuck[i]) == CO_STATUS_PENDING);
+    }
+    chan_close(empty);
+    chan_close(full);
+    for (int i = 0; i < 4; ++i)
+        CHECK(coroutine_status(sch, stuck[i]) == CO_STATUS_COMPLETED);
+    // buffered elements are still received after close
+    int v;
+    CHECK(chan_recv(full, &v) == 0 && v == 1 && chan_recv(full, &v) < 0);
+    chan_free(empty);
+    chan_free(full);
+}
+
+static void check_chan(void) {
+    scheduler *sch = scheduler_open(0);
+    CHECK(sch != NULL);
+    check_chan_on(sch);
+    scheduler_close(sch);
+    sch = scheduler_open_shared(256 * 1024);
+    CHECK(sch != NULL);
+    check_chan_on(sch);
+    scheduler_close(sch);
+}
+
+static cowheel test_wheel;
+static uint64_t fired_at[1000];
+static size_t nfired;
+
+// records the tick the wheel is at, which has to be the expiry of t
+static void record(cotimer *t, void *arg) {
+    CHECK(t->expires == test_wheel.now && (uint64_t)(uintptr_t)arg == t->expires);
+    fired_at[nfired++] = test_wheel.now;
+}
+
+// advances the wheel further from inside a callback, which must not fire anything
+static void nested(cotimer *t, void *arg) {
+    cotimer *later = arg;
+    uint64_t now = test_wheel.now;
+    CHECK(cowheel_advance(&test_wheel, now + 1000) == 0);
+    CHECK(test_wheel.now == now && later->pending);
+    // relative to the tick being fired
+    cotimer_start(&test_wheel, t, 5, record, (void *)(uintptr_t)(now + 5));
+}
+
+static void check_wheel(void) {
+    // delays below 256 ticks, across the first cascade and up to the third level
+    static cotimer timers[1000];
+    uint64_t start = 12345;
+    cowheel_init(&test_wheel, start);
+    srand(7);
+    for (int i = 0; i < 1000; ++i) {
+        uint64_t delay = 1 + (uint64_t)rand() % (i % 3 == 0 ? 255 : i % 3 == 1 ? 70000 : 300);
+        cotimer_start(&test_wheel, &timers[i], delay, record, (void *)(uintptr_t)(start + delay));
+    }
+    // cancelled ones never fire
+    for (int i = 0; i < 1000; i += 10)
+        cotimer_cancel(&test_wheel, &timers[i]);
+    CHECK(test_wheel.ntimers == 900);
+    size_t total = 0;
+    for (uint64_t now = start; now < start + 70000; now += 1 + (uint64_t)rand() % 500)
+        total += cowheel_advance(&test_wheel, now);
+    total += cowheel_advance(&test_wheel, start + 70000);
+    CHECK(total == 900 && nfired == 900 && test_wheel.ntimers == 0);
+    for (size_t i = 1; i < nfired; ++i)
+        CHECK(fired_at[i - 1] <= fired_at[i]);
+
+    // a nested advance leaves the next tick for the outer one
+    nfired = 0;
+    static cotimer first, next;
+    start = test_wheel.now;
+    cotimer_start(&test_wheel, &next, 301, record, (void *)(uintptr_t)(start + 301));
+    cotimer_start(&test_wheel, &first, 300, nested, &next);
+    CHECK(cowheel_advance(&test_wheel, start + 300) == 1);
+    CHECK(nfired == 0 && test_wheel.now == start + 300 && test_wheel.ntimers == 2);
+    CHECK(cowheel_advance(&test_wheel, start + 305) == 2);
+    CHECK(nfired == 2 && fired_at[0] == start + 301 && fired_at[1] == start + 305);
+}
+
 int main(void) {
+    check_switch();
+    check_shared_stack();
+    check_ids();
+    check_stats();
+    check_pool();
+    check_io();
+    check_wheel();
+    check_chan();
+    printf("checks passed\n");
+
     scheduler *s = scheduler_open(0);
-    struct receive_args rc_a = { coroutine_new(s, send, NULL) };
+    struct receive_args rc_a = { coroutine_new(s, send_lines, NULL) };
     coroid_t rc = coroutine_new(s, receive, &rc_a);
     // kick out the receive coroutine
     coroutine_resume(s, rc, NULL, NULL);
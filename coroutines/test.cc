@@ -0,0 +1,151 @@
+// checks of cotask.hh
+// build: cc -O2 -c coroutines.c && c++ -std=c++20 -O2 test.cc coroutines.o -o test_cc
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "cotask.hh"
+
+// stops the tests at the first failed check
+#define CHECK(COND) do { \
+        if (!(COND)) { \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #COND); \
+            std::exit(1); \
+        } \
+    } while (0)
+
+namespace {
+
+    using oneesama::task;
+    using oneesama::generator;
+
+    task<int> add(int a, int b) {
+        co_return a + b;
+    }
+
+    task<int> sum_to(int n) {
+        int sum = 0;
+        for (int i = 1; i <= n; ++i)
+            sum = co_await add(sum, i);
+        co_return sum;
+    }
+
+    task<int> fail(int n) {
+        if (n > 0) throw std::runtime_error{"fail"};
+        co_return n;
+    }
+
+    task<> fail_void() {
+        co_await fail(1);
+    }
+
+    // the exception of an awaited task comes out of co_await
+    task<int> catch_fail() {
+        try {
+            co_await fail(1);
+        } catch (const std::runtime_error &) {
+            co_return -1;
+        }
+        co_return 0;
+    }
+
+    generator<int> count(int n) {
+        for (int i = 0; i < n; ++i)
+            co_yield i;
+    }
+
+    // a stackful coroutine yielding twice what it is sent, until sent 0
+    void doubler(scheduler *sch, void *args) {
+        auto n = reinterpret_cast<long>(args);
+        while (n != 0)
+            coroutine_yield(sch, reinterpret_cast<void *>(2 * n), reinterpret_cast<void **>(&n));
+    }
+
+    // drives doubler from a task
+    task<long> drive(scheduler *sch, coroid_t cid) {
+        long total = 0;
+        for (long i = 1; i <= 10; ++i)
+            total += reinterpret_cast<long>(co_await oneesama::resume_stackful{sch, cid, reinterpret_cast<void *>(i)});
+        co_await oneesama::resume_stackful{sch, cid, nullptr};
+        co_return total;
+    }
+
+    // yields the whole stackful coroutine from a task, adding up what it is sent back
+    task<long> echo(scheduler *sch) {
+        long total = 0;
+        for (long i = 1; i <= 5; ++i)
+            total += reinterpret_cast<long>(co_await oneesama::yield_stackful{sch, reinterpret_cast<void *>(i)});
+        co_return total;
+    }
+
+    struct run_args {
+        int sum;
+        long driven;
+        long echoed;
+        bool caught;
+        bool caught_void;
+        int caught_inside;
+    };
+
+    void run_tasks(scheduler *sch, void *args) {
+        auto a = static_cast<run_args *>(args);
+        a->sum = await_in(sch, sum_to(100));
+        coroid_t d = coroutine_new(sch, doubler, reinterpret_cast<void *>(1L));
+        CHECK(d >= 0 && coroutine_resume(sch, d, nullptr, nullptr) == 0);
+        a->driven = await_in(sch, drive(sch, d));
+        CHECK(coroutine_status(sch, d) == CO_STATUS_COMPLETED);
+        a->echoed = await_in(sch, echo(sch));
+        try {
+            await_in(sch, fail(1));
+        } catch (const std::runtime_error &) {
+            a->caught = true;
+        }
+        try {
+            await_in(sch, fail_void());
+        } catch (const std::runtime_error &) {
+            a->caught_void = true;
+        }
+        a->caught_inside = await_in(sch, catch_fail());
+    }
+
+    void check_tasks() {
+        scheduler *sch = scheduler_open(0);
+        CHECK(sch != nullptr);
+        run_args a {};
+        coroid_t cid = coroutine_new(sch, run_tasks, &a);
+        void *yielded;
+        CHECK(coroutine_resume(sch, cid, nullptr, &yielded) == 0);
+        // echo() yields 1 to 5 through the stackful coroutine
+        for (long i = 1; i <= 5; ++i) {
+            CHECK(reinterpret_cast<long>(yielded) == i);
+            CHECK(coroutine_resume(sch, cid, reinterpret_cast<void *>(10 * i), &yielded) == 0);
+        }
+        CHECK(coroutine_status(sch, cid) == CO_STATUS_COMPLETED);
+        CHECK(a.sum == 5050);
+        CHECK(a.driven == 110);
+        CHECK(a.echoed == 150);
+        CHECK(a.caught && a.caught_void && a.caught_inside == -1);
+
+        // a task that does not suspend can be waited for in the main coroutine too
+        CHECK(await_in(sch, add(2, 3)) == 5);
+        scheduler_close(sch);
+    }
+
+    void check_generator() {
+        auto g = count(1000);
+        for (int i = 0; i < 1000; ++i) {
+            int *v = g.next();
+            CHECK(v != nullptr && *v == i);
+        }
+        CHECK(g.next() == nullptr);
+        CHECK(g.next() == nullptr);
+        auto empty = count(0);
+        CHECK(empty.next() == nullptr);
+    }
+}
+
+int main() {
+    check_tasks();
+    check_generator();
+    std::printf("checks passed\n");
+}
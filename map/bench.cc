@@ -0,0 +1,261 @@
+// benchmarks of Map, oneesama::hash_map and std::unordered_map
+// build: cc -O2 -c map.c && c++ -std=c++17 -O2 bench.cc map.o -o bench
+// usage: ./bench [-m max_size] [-k keys]
+//   -m  largest number of pairs, in powers of ten from 1000 (default 1000000, up to 100000000)
+//   -k  only this key distribution: uniform, zipf, sequential, adversarial or collide
+// every result is printed as one json object per line. put latencies, which include
+// the pauses of resizes, are reported as percentiles and as a log2 histogram in ns
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <malloc.h>
+#include <unistd.h>
+
+#include "map.h"
+#include "map.hh"
+
+namespace {
+
+    using clk = std::chrono::steady_clock;
+
+    double ns_since(clk::time_point t0) {
+        return std::chrono::duration<double, std::nano>(clk::now() - t0).count();
+    }
+
+    // bytes allocated with malloc, including big mmapped blocks
+    std::size_t heap_bytes() {
+        auto mi = mallinfo2();
+        return mi.uordblks + mi.hblkhd;
+    }
+
+    // every key hashes the same; only used with small sizes
+    struct collide_hash {
+        std::size_t operator()(std::uint64_t) const { return 42; }
+    };
+
+    struct id_hash {
+        std::size_t operator()(std::uint64_t k) const { return static_cast<std::size_t>(k); }
+    };
+
+    std::size_t c_id_hash(Map *, void *key) { return reinterpret_cast<std::size_t>(key); }
+    std::size_t c_collide_hash(Map *, void *) { return 42; }
+    bool c_equal(void *a, void *b) { return a == b; }
+
+    // the maps behind one interface; keys are never 0
+    class c_map {
+    public:
+        static constexpr const char *name = "Map";
+        explicit c_map(bool collide) : m_{createHashMap(collide ? c_collide_hash : c_id_hash, c_equal)} {}
+        ~c_map() { m_->free(m_); }
+        void put(std::uint64_t k, std::uint64_t v) { m_->put(m_, as_ptr(k), as_ptr(v)); }
+        std::uint64_t get(std::uint64_t k) { return reinterpret_cast<std::uintptr_t>(m_->get(m_, as_ptr(k))); }
+        void remove(std::uint64_t k) { m_->remove(m_, as_ptr(k)); }
+        std::uint64_t sum() {
+            MapIterator it;
+            initHashMapIterator(&it, m_);
+            std::uint64_t s = 0;
+            while (it.has_next(&it)) s += reinterpret_cast<std::uintptr_t>(it.next(&it)->curr->value);
+            it.free(&it);
+            return s;
+        }
+    private:
+        Map *m_;
+        static void *as_ptr(std::uint64_t x) { return reinterpret_cast<void *>(static_cast<std::uintptr_t>(x)); }
+    };
+
+    template<class Hash>
+    class typed_map {
+    public:
+        static constexpr const char *name = "oneesama::hash_map";
+        explicit typed_map(bool) {}
+        void put(std::uint64_t k, std::uint64_t v) { m_.insert_or_assign(k, v); }
+        std::uint64_t get(std::uint64_t k) {
+            auto v = m_.find(k);
+            return v ? *v : 0;
+        }
+        void remove(std::uint64_t k) { m_.erase(k); }
+        std::uint64_t sum() {
+            std::uint64_t s = 0;
+            for (auto &e : m_) s += e.value;
+            return s;
+        }
+    private:
+        oneesama::hash_map<std::uint64_t, std::uint64_t, Hash> m_;
+    };
+
+    template<class Hash>
+    class std_map {
+    public:
+        static constexpr const char *name = "std::unordered_map";
+        explicit std_map(bool) {}
+        void put(std::uint64_t k, std::uint64_t v) { m_[k] = v; }
+        std::uint64_t get(std::uint64_t k) {
+            auto it = m_.find(k);
+            return it == m_.end() ? 0 : it->second;
+        }
+        void remove(std::uint64_t k) { m_.erase(k); }
+        std::uint64_t sum() {
+            std::uint64_t s = 0;
+            for (auto &e : m_) s += e.second;
+            return s;
+        }
+    private:
+        std::unordered_map<std::uint64_t, std::uint64_t, Hash> m_;
+    };
+
+    // zipfian ranks in [0, n) with the generator of gray et al.
+    class zipf {
+    public:
+        zipf(std::uint64_t n, double theta) : n_{n}, theta_{theta} {
+            double zeta2 = 1 + std::pow(0.5, theta);
+            for (std::uint64_t i = 1; i <= n; ++i) zetan_ += 1 / std::pow(static_cast<double>(i), theta);
+            alpha_ = 1 / (1 - theta);
+            eta_ = (1 - std::pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan_);
+        }
+        template<class Rng>
+        std::uint64_t operator()(Rng &rng) {
+            double u = std::uniform_real_distribution<double>{}(rng);
+            double uz = u * zetan_;
+            if (uz < 1) return 0;
+            if (uz < 1 + std::pow(0.5, theta_)) return 1;
+            return std::min<std::uint64_t>(n_ - 1, static_cast<std::uint64_t>(n_ * std::pow(eta_ * u - eta_ + 1, alpha_)));
+        }
+    private:
+        std::uint64_t n_;
+        double theta_, zetan_ {}, alpha_ {}, eta_ {};
+    };
+
+    struct workload {
+        std::string dist;
+        std::vector<std::uint64_t> keys;    // put in this order, then removed
+        std::vector<std::uint64_t> queries; // all hits
+    };
+
+    workload make_workload(const std::string &dist, std::size_t n) {
+        workload w{dist, {}, {}};
+        std::mt19937_64 rng{12345};
+        w.keys.resize(n);
+        for (std::size_t i = 0; i < n; ++i) {
+            if (dist == "sequential") w.keys[i] = i + 1;
+            // differ only in the high half, which defeats tables that mask the low bits
+            else if (dist == "adversarial") w.keys[i] = static_cast<std::uint64_t>(i + 1) << 32;
+            else w.keys[i] = rng() | 1;
+        }
+        if (dist == "uniform" || dist == "zipf" || dist == "collide") {
+            // random keys may repeat; keep them distinct
+            std::sort(w.keys.begin(), w.keys.end());
+            w.keys.erase(std::unique(w.keys.begin(), w.keys.end()), w.keys.end());
+            std::shuffle(w.keys.begin(), w.keys.end(), rng);
+        }
+        // at least a million lookups, except where each one walks every key
+        std::size_t nq = dist == "collide" ? w.keys.size() : std::max<std::size_t>(w.keys.size(), 1000000);
+        w.queries.resize(nq);
+        if (dist == "zipf") {
+            zipf z{w.keys.size(), 0.99};
+            for (auto &q : w.queries) q = w.keys[z(rng)];
+        } else {
+            std::uniform_int_distribution<std::size_t> pick{0, w.keys.size() - 1};
+            for (auto &q : w.queries) q = w.keys[pick(rng)];
+        }
+        return w;
+    }
+
+    double percentile(std::vector<float> &sorted, double p) {
+        return sorted[static_cast<std::size_t>((sorted.size() - 1) * p)];
+    }
+
+    template<class M>
+    void run(const workload &w) {
+        std::size_t n = w.keys.size();
+        std::vector<float> lat(n);
+        std::size_t heap0 = heap_bytes();
+        auto m = new M{w.dist == "collide"};
+
+        auto t0 = clk::now();
+        for (std::size_t i = 0; i < n; ++i) {
+            auto s = clk::now();
+            m->put(w.keys[i], i + 1);
+            lat[i] = static_cast<float>(ns_since(s));
+        }
+        double put_ns = ns_since(t0) / n;
+        double bytes = static_cast<double>(heap_bytes() - heap0) / n;
+
+        std::uint64_t check = 0;
+        t0 = clk::now();
+        for (auto q : w.queries) check += m->get(q);
+        double get_ns = ns_since(t0) / w.queries.size();
+
+        t0 = clk::now();
+        check += m->sum();
+        double iter_ns = ns_since(t0) / n;
+
+        t0 = clk::now();
+        for (auto k : w.keys) m->remove(k);
+        double remove_ns = ns_since(t0) / n;
+        delete m;
+
+        std::vector<std::size_t> hist;
+        for (auto l : lat) {
+            std::size_t b = l < 1 ? 0 : static_cast<std::size_t>(std::log2(l));
+            if (hist.size() <= b) hist.resize(b + 1);
+            ++hist[b];
+        }
+        std::sort(lat.begin(), lat.end());
+        std::printf("{\"bench\":\"map\",\"impl\":\"%s\",\"keys\":\"%s\",\"size\":%zu,"
+                    "\"put_ns\":%.1f,\"get_ns\":%.1f,\"iterate_ns\":%.1f,\"remove_ns\":%.1f,"
+                    "\"bytes_per_entry\":%.1f,\"put_latency_ns\":{\"p50\":%.0f,\"p99\":%.0f,"
+                    "\"p999\":%.0f,\"max\":%.0f},\"put_log2_hist\":[",
+            M::name, w.dist.c_str(), n, put_ns, get_ns, iter_ns, remove_ns, bytes,
+            percentile(lat, 0.5), percentile(lat, 0.99), percentile(lat, 0.999), percentile(lat, 1.0));
+        for (std::size_t i = 0; i < hist.size(); ++i) std::printf(i ? ",%zu" : "%zu", hist[i]);
+        // check keeps the lookups from being optimized away
+        std::printf("],\"check\":%llu}\n", static_cast<unsigned long long>(check & 0xFFFF));
+        std::fflush(stdout);
+    }
+}
+
+int main(int argc, char **argv) {
+    std::size_t max_size = 1000000;
+    std::string only;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:k:")) != -1) {
+        switch (opt) {
+            case 'm':
+                max_size = std::strtoull(optarg, nullptr, 10);
+                break;
+            case 'k':
+                only = optarg;
+                break;
+            default:
+                std::fprintf(stderr, "usage: %s [-m max_size] [-k keys]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    for (const char *dist : {"uniform", "zipf", "sequential", "adversarial", "collide"}) {
+        if (!only.empty() && only != dist) continue;
+        for (std::size_t n = 1000; n <= max_size && n <= 100000000; n *= 10) {
+            // every key in one chain or probe sequence: quadratic, so keep it small
+            if (std::strcmp(dist, "collide") == 0 && n > 10000) break;
+            auto w = make_workload(dist, n);
+            if (std::strcmp(dist, "collide") == 0) {
+                run<c_map>(w);
+                run<typed_map<collide_hash>>(w);
+                run<std_map<collide_hash>>(w);
+            } else {
+                run<c_map>(w);
+                run<typed_map<id_hash>>(w);
+                run<std_map<id_hash>>(w);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,383 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cmap.h"
+#include "map.h"
+
+#define NEW(TYPE, LEN) (TYPE*)malloc(sizeof(TYPE) * LEN)
+
+#define CACHELINE 64
+
+// writers lock the stripe of the low bits of the hash. there are never fewer buckets
+// than stripes, so a bucket keeps its stripe across resizes
+#define NSTRIPES 64
+#define MIN_BUCKETS NSTRIPES
+
+// reader counters are spread over slots so that readers on different cores do not
+// write the same cache line
+#define NREADERSLOTS 64
+
+// removed nodes waiting to be freed before a grace period is forced
+#define RETIRE_BATCH 256
+
+typedef struct cnode {
+    void *key;
+    _Atomic(void *) value;
+    size_t hash;
+    _Atomic(struct cnode *) next;
+    struct cnode *retired;     // link in the list of retired nodes
+} cnode;
+
+typedef struct ctable {
+    size_t nbuckets;           // power of two
+    struct ctable *retired;    // link in the list of retired tables
+    _Atomic(cnode *) buckets[];
+} ctable;
+
+typedef struct {
+    pthread_mutex_t mtx;
+    char pad[CACHELINE - sizeof(pthread_mutex_t) % CACHELINE];
+} stripe;
+
+typedef struct {
+    atomic_size_t count[2];    // readers inside, by parity of the epoch they entered in
+    char pad[CACHELINE - 2 * sizeof(atomic_size_t)];
+} readerslot;
+
+struct cmap_state {
+    _Atomic(ctable *) table;
+    atomic_size_t size;
+    atomic_size_t epoch;
+    stripe stripes[NSTRIPES];
+    readerslot readers[NREADERSLOTS];
+    pthread_mutex_t gcmtx;     // guards the retired lists and grace periods
+    cnode *retired_nodes;
+    ctable *retired_tables;
+    size_t nretired;
+};
+
+static size_t df_hashcode(ConcurrentMap *map, void *key) {
+    (void)map;
+    // assumes key is string
+    return stringHashcode((const char*)key);
+}
+
+static bool df_k_equal(void *key1, void *key2) {
+    return strcmp((const char*)key1, (const char*)key2) ? false : true;
+}
+
+// the reader slot of this thread
+static size_t reader_slot(void) {
+    static atomic_size_t next_slot;
+    static _Thread_local size_t slot = (size_t)-1;
+    if (slot == (size_t)-1)
+        slot = atomic_fetch_add(&next_slot, 1) % NREADERSLOTS;
+    return slot;
+}
+
+// announces a reader in the current epoch, and returns the counter to decrement
+// with read_unlock(). nothing retired after this is freed before that
+static atomic_size_t *read_lock(struct cmap_state *st) {
+    readerslot *r = &st->readers[reader_slot()];
+    for (;;) {
+        size_t e = atomic_load(&st->epoch);
+        atomic_size_t *c = &r->count[e & 1];
+        atomic_fetch_add(c, 1);
+        // a grace period that started meanwhile might not have seen the increment
+        if (atomic_load(&st->epoch) == e)
+            return c;
+        atomic_fetch_sub(c, 1);
+    }
+}
+
+static void read_unlock(atomic_size_t *c) {
+    atomic_fetch_sub_explicit(c, 1, memory_order_release);
+}
+
+// waits until every reader that entered before the call is done.
+// must be called with gcmtx held
+static void synchronize(struct cmap_state *st) {
+    size_t e = atomic_fetch_add(&st->epoch, 1);
+    for (size_t i = 0; i < NREADERSLOTS; ++i)
+        while (atomic_load(&st->readers[i].count[e & 1]) != 0)
+            sched_yield();
+}
+
+static void table_free(ctable *t) {
+    for (size_t i = 0; i < t->nbuckets; ++i) {
+        cnode *n = atomic_load_explicit(&t->buckets[i], memory_order_relaxed);
+        while (n != NULL) {
+            cnode *next = atomic_load_explicit(&n->next, memory_order_relaxed);
+            free(n);
+            n = next;
+        }
+    }
+    free(t);
+}
+
+// frees everything retired so far, after a grace period
+static void reclaim(struct cmap_state *st) {
+    pthread_mutex_lock(&st->gcmtx);
+    cnode *nodes = st->retired_nodes;
+    ctable *tables = st->retired_tables;
+    st->retired_nodes = NULL;
+    st->retired_tables = NULL;
+    st->nretired = 0;
+    if (nodes != NULL || tables != NULL)
+        synchronize(st);
+    pthread_mutex_unlock(&st->gcmtx);
+
+    while (nodes != NULL) {
+        cnode *next = nodes->retired;
+        free(nodes);
+        nodes = next;
+    }
+    while (tables != NULL) {
+        ctable *next = tables->retired;
+        table_free(tables);
+        tables = next;
+    }
+}
+
+static void retire_node(struct cmap_state *st, cnode *n) {
+    pthread_mutex_lock(&st->gcmtx);
+    n->retired = st->retired_nodes;
+    st->retired_nodes = n;
+    bool full = ++st->nretired >= RETIRE_BATCH;
+    pthread_mutex_unlock(&st->gcmtx);
+    if (full)
+        reclaim(st);
+}
+
+static void retire_table(struct cmap_state *st, ctable *t) {
+    pthread_mutex_lock(&st->gcmtx);
+    t->retired = st->retired_tables;
+    st->retired_tables = t;
+    pthread_mutex_unlock(&st->gcmtx);
+}
+
+static ctable *table_alloc(size_t nbuckets) {
+    ctable *t = (ctable *)malloc(sizeof(ctable) + nbuckets * sizeof(_Atomic(cnode *)));
+    if (t == NULL)
+        return NULL;
+    t->nbuckets = nbuckets;
+    t->retired = NULL;
+    for (size_t i = 0; i < nbuckets; ++i)
+        atomic_init(&t->buckets[i], NULL);
+    return t;
+}
+
+static inline size_t map_hash(ConcurrentMap *map, void *key) {
+    uint64_t h = (uint64_t)map->hashcode(map, key);
+    if (map->hashcode == df_hashcode)
+        return (size_t)h;
+    // spread weak custom hashcodes over the bucket bits
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+static cnode *bucket_find(ConcurrentMap *map, _Atomic(cnode *) *bucket, void *key, size_t hash) {
+    cnode *n = atomic_load_explicit(bucket, memory_order_acquire);
+    while (n != NULL && !(n->hash == hash && map->k_equal(key, n->key)))
+        n = atomic_load_explicit(&n->next, memory_order_acquire);
+    return n;
+}
+
+static void lock_all(struct cmap_state *st) {
+    for (size_t i = 0; i < NSTRIPES; ++i)
+        pthread_mutex_lock(&st->stripes[i].mtx);
+}
+
+static void unlock_all(struct cmap_state *st) {
+    for (size_t i = NSTRIPES; i-- > 0; )
+        pthread_mutex_unlock(&st->stripes[i].mtx);
+}
+
+// doubles the buckets. the nodes are copied, so that readers still walking the
+// old buckets are never led into a chain of the new ones
+static void grow(ConcurrentMap *map) {
+    struct cmap_state *st = map->state;
+    lock_all(st);
+    ctable *old = atomic_load_explicit(&st->table, memory_order_relaxed);
+    if (atomic_load(&st->size) <= old->nbuckets) {
+        // another writer grew it already
+        unlock_all(st);
+        return;
+    }
+    ctable *t = table_alloc(old->nbuckets * 2);
+    if (t == NULL) {
+        unlock_all(st);
+        return;
+    }
+    size_t mask = t->nbuckets - 1;
+    for (size_t i = 0; i < old->nbuckets; ++i) {
+        cnode *n = atomic_load_explicit(&old->buckets[i], memory_order_relaxed);
+        for (; n != NULL; n = atomic_load_explicit(&n->next, memory_order_relaxed)) {
+            cnode *c = NEW(cnode, 1);
+            if (c == NULL) {
+                table_free(t);
+                unlock_all(st);
+                return;
+            }
+            c->key = n->key;
+            atomic_init(&c->value, atomic_load_explicit(&n->value, memory_order_relaxed));
+            c->hash = n->hash;
+            atomic_init(&c->next, atomic_load_explicit(&t->buckets[c->hash & mask], memory_order_relaxed));
+            c->retired = NULL;
+            atomic_store_explicit(&t->buckets[c->hash & mask], c, memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&st->table, t, memory_order_release);
+    unlock_all(st);
+    retire_table(st, old);
+    reclaim(st);
+}
+
+static int df_put(ConcurrentMap *map, void *key, void *value) {
+    struct cmap_state *st = map->state;
+    size_t hash = map_hash(map, key);
+    pthread_mutex_t *mtx = &st->stripes[hash % NSTRIPES].mtx;
+    pthread_mutex_lock(mtx);
+    // the buckets do not change while a stripe is locked
+    ctable *t = atomic_load_explicit(&st->table, memory_order_acquire);
+    _Atomic(cnode *) *bucket = &t->buckets[hash & (t->nbuckets - 1)];
+    cnode *n = bucket_find(map, bucket, key, hash);
+    if (n != NULL) {
+        // existing key
+        atomic_store_explicit(&n->value, value, memory_order_release);
+        pthread_mutex_unlock(mtx);
+        return 0;
+    }
+    if ((n = NEW(cnode, 1)) == NULL) {
+        pthread_mutex_unlock(mtx);
+        return 1;
+    }
+    n->key = key;
+    atomic_init(&n->value, value);
+    n->hash = hash;
+    atomic_init(&n->next, atomic_load_explicit(bucket, memory_order_relaxed));
+    n->retired = NULL;
+    atomic_store_explicit(bucket, n, memory_order_release);
+    size_t size = atomic_fetch_add(&st->size, 1) + 1;
+    size_t nbuckets = t->nbuckets;
+    pthread_mutex_unlock(mtx);
+
+    // scatter k-v pairs when there are more than buckets
+    if (size > nbuckets)
+        grow(map);
+    return 0;
+}
+
+static void *df_get(ConcurrentMap *map, void *key) {
+    struct cmap_state *st = map->state;
+    size_t hash = map_hash(map, key);
+    atomic_size_t *c = read_lock(st);
+    ctable *t = atomic_load_explicit(&st->table, memory_order_acquire);
+    cnode *n = bucket_find(map, &t->buckets[hash & (t->nbuckets - 1)], key, hash);
+    void *value = n == NULL ? NULL : atomic_load_explicit(&n->value, memory_order_acquire);
+    read_unlock(c);
+    return value;
+}
+
+static bool df_exists(ConcurrentMap *map, void *key) {
+    struct cmap_state *st = map->state;
+    size_t hash = map_hash(map, key);
+    atomic_size_t *c = read_lock(st);
+    ctable *t = atomic_load_explicit(&st->table, memory_order_acquire);
+    bool found = bucket_find(map, &t->buckets[hash & (t->nbuckets - 1)], key, hash) != NULL;
+    read_unlock(c);
+    return found;
+}
+
+static void df_remove(ConcurrentMap *map, void *key) {
+    struct cmap_state *st = map->state;
+    size_t hash = map_hash(map, key);
+    pthread_mutex_t *mtx = &st->stripes[hash % NSTRIPES].mtx;
+    pthread_mutex_lock(mtx);
+    ctable *t = atomic_load_explicit(&st->table, memory_order_acquire);
+    _Atomic(cnode *) *link = &t->buckets[hash & (t->nbuckets - 1)];
+    cnode *n;
+    while ((n = atomic_load_explicit(link, memory_order_relaxed)) != NULL) {
+        if (n->hash == hash && map->k_equal(key, n->key)) {
+            // readers on n still find the rest of the chain through n->next
+            atomic_store_explicit(link, atomic_load_explicit(&n->next, memory_order_relaxed),
+                                  memory_order_release);
+            atomic_fetch_sub(&st->size, 1);
+            break;
+        }
+        link = &n->next;
+    }
+    pthread_mutex_unlock(mtx);
+    if (n != NULL)
+        retire_node(st, n);
+}
+
+static size_t df_size(ConcurrentMap *map) {
+    return atomic_load(&map->state->size);
+}
+
+static void df_clear(ConcurrentMap *map) {
+    struct cmap_state *st = map->state;
+    ctable *t = table_alloc(MIN_BUCKETS);
+    if (t == NULL)
+        return;
+    lock_all(st);
+    ctable *old = atomic_load_explicit(&st->table, memory_order_relaxed);
+    atomic_store_explicit(&st->table, t, memory_order_release);
+    atomic_store(&st->size, 0);
+    unlock_all(st);
+    retire_table(st, old);
+    reclaim(st);
+}
+
+static void df_free(ConcurrentMap *map) {
+    struct cmap_state *st = map->state;
+    reclaim(st);
+    table_free(atomic_load_explicit(&st->table, memory_order_relaxed));
+    for (size_t i = 0; i < NSTRIPES; ++i)
+        pthread_mutex_destroy(&st->stripes[i].mtx);
+    pthread_mutex_destroy(&st->gcmtx);
+    free(st);
+    free(map);
+}
+
+ConcurrentMap *createConcurrentHashMap(chashcode_func hashcode, ckey_equal_func k_equal) {
+    ConcurrentMap *map = NEW(ConcurrentMap, 1);
+    struct cmap_state *st = NEW(struct cmap_state, 1);
+    ctable *t = table_alloc(MIN_BUCKETS);
+    if (map == NULL || st == NULL || t == NULL) {
+        free(map);
+        free(st);
+        free(t);
+        return NULL;
+    }
+    atomic_init(&st->table, t);
+    atomic_init(&st->size, 0);
+    atomic_init(&st->epoch, 0);
+    for (size_t i = 0; i < NSTRIPES; ++i)
+        pthread_mutex_init(&st->stripes[i].mtx, NULL);
+    for (size_t i = 0; i < NREADERSLOTS; ++i) {
+        atomic_init(&st->readers[i].count[0], 0);
+        atomic_init(&st->readers[i].count[1], 0);
+    }
+    pthread_mutex_init(&st->gcmtx, NULL);
+    st->retired_nodes = NULL;
+    st->retired_tables = NULL;
+    st->nretired = 0;
+
+    map->state = st;
+    map->hashcode = hashcode == NULL ? df_hashcode : hashcode;
+    map->k_equal = k_equal == NULL ? df_k_equal : k_equal;
+    map->put = df_put;
+    map->get = df_get;
+    map->remove = df_remove;
+    map->exists = df_exists;
+    map->size = df_size;
+    map->clear = df_clear;
+    map->free = df_free;
+    return map;
+}
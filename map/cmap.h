@@ -0,0 +1,41 @@
+// hashmap that can be shared by threads; build with -pthread
+#pragma once
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct ConcurrentMap;
+
+// returns a hash of key, like hashcode_func of map.h
+typedef size_t (*chashcode_func)(struct ConcurrentMap *map, void *key);
+typedef bool (*ckey_equal_func)(void *key1, void *key2);
+
+// hashmap with chained buckets. get and exists take no lock: they only announce
+// themselves in a reader counter of the current epoch. put and remove lock one of
+// 64 stripes of buckets. removed nodes and the buckets of a resize are freed once
+// every reader that might still see them is done. resizing blocks writers only
+typedef struct ConcurrentMap {
+    struct cmap_state *state;                                      // internal
+    chashcode_func hashcode;                                       // hashcode function
+    ckey_equal_func k_equal;                                       // checks whether two keys are equal
+    int (*put)(struct ConcurrentMap *map, void *key, void *value); // add k and v
+    void *(*get)(struct ConcurrentMap *map, void *key);            // gets k
+    void (*remove)(struct ConcurrentMap *map, void *key);          // remove k
+    bool (*exists)(struct ConcurrentMap *map, void *key);          // checks if key exists
+    size_t (*size)(struct ConcurrentMap *map);                     // current k-v pairs
+    void (*clear)(struct ConcurrentMap *map);                      // clears all keys
+    void (*free)(struct ConcurrentMap *map);                       // free the map; no thread may use it anymore
+} ConcurrentMap;
+
+// creates a new concurrent map with custom hashcode and equal functions.
+// default ones for string are used if they are NULL
+// NULL is returned if this fails
+ConcurrentMap *createConcurrentHashMap(chashcode_func hashcode, ckey_equal_func k_equal);
+
+#ifdef __cplusplus
+}
+#endif
@@ -1,203 +1,506 @@
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "map.h"
 
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
 #define NEW(TYPE, LEN) (TYPE*)malloc(sizeof(TYPE) * LEN)
 
+// control bytes. a full slot has the 7 low bits of its hash, with the high bit clear
+#define CTRL_EMPTY   ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xFE)
+#define IS_FULL(C)   (((C) & 0x80) == 0)
+
+// slots are probed a group at a time. groups are aligned to GROUP_WIDTH slots,
+// so a probe never wraps around in the middle of a group
+#define GROUP_WIDTH   16
+#define MIN_LIST_SIZE 16
+
+// default load factors. growing halves the load and shrinking doubles it, so the
+// minimum has to stay under half of the maximum for resizes not to undo each other
+#define DF_MAX_LOAD 0.875f
+#define DF_MIN_LOAD 0.25f
+
+// bounds of the maximum load factor: a slot of every 16 is always empty, and a
+// resize always makes room for at least one more pair
+#define MIN_MAX_LOAD 0.0625f
+#define MAX_MAX_LOAD 0.9375f
+
+// slots that can be taken by full or deleted ones before growing
+#define MAX_LOAD(MAP, LISTSIZE) ((size_t)((LISTSIZE) * (double)(MAP)->max_load))
+
+// groups of old slots moved by each operation during a resize. a resize ends after
+// old slots / (GROUP_WIDTH * MIGRATE_GROUPS) operations, and min_load leaves room for
+// that many puts after shrinking
+#define MIGRATE_GROUPS 2
+
+#define H1(HASH) ((HASH) >> 7)
+#define H2(HASH) ((uint8_t)((HASH) & 0x7F))
+
+// a set of slots of a group. the lowest one is MASK_LANE(m), m &= m - 1 drops it
+#if defined(__SSE2__)
+typedef uint32_t groupmask;
+#define LANE_SHIFT 0
+
+static inline groupmask group_match(const uint8_t *g, uint8_t h2) {
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)g);
+    return (groupmask)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)h2)));
+}
+
+// empty or deleted slots, i.e. those with the high bit set
+static inline groupmask group_match_free(const uint8_t *g) {
+    return (groupmask)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+}
+#elif defined(__ARM_NEON)
+// neon has no movemask: narrowing gives 4 bits per slot, one of them is kept
+typedef uint64_t groupmask;
+#define LANE_SHIFT 2
+
+static inline groupmask neon_mask(uint8x16_t eq) {
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x8888888888888888ULL;
+}
+
+static inline groupmask group_match(const uint8_t *g, uint8_t h2) {
+    return neon_mask(vceqq_u8(vld1q_u8(g), vdupq_n_u8(h2)));
+}
+
+static inline groupmask group_match_free(const uint8_t *g) {
+    return neon_mask(vtstq_u8(vld1q_u8(g), vdupq_n_u8(0x80)));
+}
+#else
+typedef uint32_t groupmask;
+#define LANE_SHIFT 0
+
+static inline groupmask group_match(const uint8_t *g, uint8_t h2) {
+    groupmask m = 0;
+    for (int i = 0; i < GROUP_WIDTH; ++i)
+        m |= (groupmask)(g[i] == h2) << i;
+    return m;
+}
+
+static inline groupmask group_match_free(const uint8_t *g) {
+    groupmask m = 0;
+    for (int i = 0; i < GROUP_WIDTH; ++i)
+        m |= (groupmask)(g[i] >> 7) << i;
+    return m;
+}
+#endif
+
+#define MASK_LANE(M) ((size_t)__builtin_ctzll(M) >> LANE_SHIFT)
+
+static inline groupmask group_match_empty(const uint8_t *g) {
+    return group_match(g, CTRL_EMPTY);
+}
+
+// 64x64 bit multiplication, folding the high half of the product into the low one
+static inline uint64_t wy_mum(uint64_t a, uint64_t b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)a * b;
+    return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+    uint64_t ha = a >> 32, hb = b >> 32, la = (uint32_t)a, lb = (uint32_t)b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    uint64_t hi = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+    return lo ^ hi;
+#endif
+}
+
+static inline uint64_t wy_r8(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+static inline uint64_t wy_r4(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+// wyhash: reads 8 bytes at a time and mixes 48 bytes per round with three
+// independent multiplications
+static uint64_t wyhash(const void *key, size_t len) {
+    static const uint64_t s[4] = {
+        0xa0761d6478bd642fULL, 0xe7037ed1a0b428dbULL, 0x8ebc6af09c88c6e3ULL, 0x589965cc75374cc3ULL
+    };
+    const uint8_t *p = (const uint8_t *)key;
+    uint64_t seed = wy_mum(s[0], s[1]);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (wy_r4(p) << 32) | wy_r4(p + ((len >> 3) << 2));
+            b = (wy_r4(p + len - 4) << 32) | wy_r4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = wy_mum(wy_r8(p) ^ s[1], wy_r8(p + 8) ^ seed);
+                see1 = wy_mum(wy_r8(p + 16) ^ s[2], wy_r8(p + 24) ^ see1);
+                see2 = wy_mum(wy_r8(p + 32) ^ s[3], wy_r8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = wy_mum(wy_r8(p) ^ s[1], wy_r8(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = wy_r8(p + i - 16);
+        b = wy_r8(p + i - 8);
+    }
+    return wy_mum(s[1] ^ len, wy_mum(a ^ s[1], b ^ seed));
+}
+
+size_t stringHashcode(const char *key) {
+    return (size_t)wyhash(key, strlen(key));
+}
+
 static size_t df_hashcode(Map *map, void *key) {
+    (void)map;
     // assumes key is string
-    const char *k = (const char*)key;
-    size_t h = 0;
-    while (*k) {
-        h = (h << 4) + *k++;
-        size_t g = h & 0xF0000000L;
-        if (g)
-            h ^= g >> 24;
-        h &= ~g;
-    }
-    return h % map->list_size;
+    return stringHashcode((const char*)key);
 }
 
 static bool df_k_equal(void *key1, void *key2) {
     return strcmp((const char*)key1, (const char*)key2) ? false : true;
 }
 
-static int reset_hashmap(Map *map, size_t newlistsize) {
-    if (newlistsize == 0)
-        newlistsize = 8;
-    if (newlistsize < 8)
-        return 0;
+// spreads the bits of a custom hashcode over the whole word, so that weak hashcodes
+// still give useful slot and control bits
+static inline size_t map_hash(Map *map, void *key) {
+    uint64_t h = (uint64_t)map->hashcode(map, key);
+    if (map->hashcode == df_hashcode)
+        return (size_t)h;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
 
-    // put everything in temp storage
-    size_t npairs = map->size;
-    MapEntry *tmplist = NEW(MapEntry, newlistsize);
-    if (tmplist == NULL)
-        return 1;
-    MapIterator *it = createHashMapIterator(map);
-    if (it == NULL) {
-        free(tmplist);
-        return 1;
+// returns the slot of key among listsize slots, or listsize if it is not there.
+// groups are visited with triangular steps, which reaches each of them once
+static size_t find_in(Map *map, const uint8_t *ctrls, MapEntry *list, size_t listsize,
+                      void *key, size_t hash) {
+    size_t gmask = listsize / GROUP_WIDTH - 1;
+    size_t g = H1(hash) & gmask;
+    for (size_t step = 1; ; ++step) {
+        const uint8_t *ctrl = ctrls + g * GROUP_WIDTH;
+        for (groupmask m = group_match(ctrl, H2(hash)); m != 0; m &= m - 1) {
+            size_t i = g * GROUP_WIDTH + MASK_LANE(m);
+            if (list[i].hash == hash && map->k_equal(key, list[i].key))
+                return i;
+        }
+        // a key is never placed past a group that had an empty slot
+        if (group_match_empty(ctrl) != 0)
+            return listsize;
+        g = (g + step) & gmask;
     }
-    for (size_t i = 0; it->has_next(it); ++i) {
-        it = it->next(it);
-        tmplist[i].key = it->curr->key;
-        tmplist[i].value = it->curr->value;
-        tmplist[i].next = NULL;
+}
+
+// returns the slot of key, or NULL if it is not in the map. *old tells whether
+// it is one of the old slots that are not moved yet
+static MapEntry *find(Map *map, void *key, size_t hash, size_t *index, bool *old) {
+    if (map->size == 0)
+        return NULL;
+    *old = false;
+    *index = find_in(map, map->ctrl, map->list, map->list_size, key, hash);
+    if (*index != map->list_size)
+        return &map->list[*index];
+    if (map->oldlist == NULL)
+        return NULL;
+    *old = true;
+    *index = find_in(map, map->oldctrl, map->oldlist, map->old_list_size, key, hash);
+    if (*index != map->old_list_size)
+        return &map->oldlist[*index];
+    return NULL;
+}
+
+// returns the first empty or deleted slot on the probe sequence of hash
+static size_t find_free(Map *map, size_t hash) {
+    size_t gmask = map->list_size / GROUP_WIDTH - 1;
+    size_t g = H1(hash) & gmask;
+    for (size_t step = 1; ; ++step) {
+        groupmask m = group_match_free(map->ctrl + g * GROUP_WIDTH);
+        if (m != 0)
+            return g * GROUP_WIDTH + MASK_LANE(m);
+        g = (g + step) & gmask;
     }
-    it->free(it);
+}
 
-    // clear data of existing k-v pairs
-    map->size = 0;
-    for (size_t i = 0; i < map->list_size; ++i) {
-        MapEntry *curr = &map->list[i];
-        curr->key = NULL;
-        curr->value = NULL;
-        while (curr->next != NULL) {
-            MapEntry *tmp = curr->next->next;
-            free(curr->next);
-            curr->next = tmp;
+// puts a pair whose key is known not to be in the slots
+static void insert(Map *map, size_t hash, void *key, void *value) {
+    size_t index = find_free(map, hash);
+    if (map->ctrl[index] == CTRL_EMPTY)
+        --map->growth_left;
+    map->ctrl[index] = H2(hash);
+    map->list[index].key = key;
+    map->list[index].value = value;
+    map->list[index].hash = hash;
+}
+
+// moves the pairs of up to ngroups groups of the old slots, and frees the old
+// slots when they are all moved. moved slots are marked deleted, so that
+// probes of the old slots still go past them
+static void migrate(Map *map, size_t ngroups) {
+    size_t total = map->old_list_size / GROUP_WIDTH;
+    for (; ngroups > 0 && map->migrated < total; --ngroups, ++map->migrated) {
+        size_t start = map->migrated * GROUP_WIDTH;
+        for (size_t i = start; i < start + GROUP_WIDTH; ++i) {
+            if (!IS_FULL(map->oldctrl[i]))
+                continue;
+            insert(map, map->oldlist[i].hash, map->oldlist[i].key, map->oldlist[i].value);
+            map->oldctrl[i] = CTRL_DELETED;
+            --map->old_size;
         }
     }
-
-    // reinitialize list
-    MapEntry *newlist = (MapEntry*)realloc(map->list, sizeof(MapEntry) * newlistsize);
-    if (newlist != NULL) {
-        map->list_size = newlistsize;
-        map->list = newlist;
+    if (map->migrated == total) {
+        free(map->oldlist);
+        map->oldctrl = NULL;
+        map->oldlist = NULL;
+        map->old_list_size = 0;
+        map->migrated = 0;
     }
-    for (size_t i = 0; i < map->list_size; ++i)
-        memset(&map->list[i], 0, sizeof(MapEntry));
+}
+
+// the small step of moving that every operation takes
+static inline void migrate_step(Map *map) {
+    if (map->oldlist != NULL && map->iterators == 0)
+        migrate(map, MIGRATE_GROUPS);
+}
 
-    // re-put all the k-v pairs
-    for (size_t i = 0; i < npairs; ++i)
-        map->put(map, tmplist[i].key, tmplist[i].value);
+// moves every pair of some slots to the current ones and frees them
+static void move_all(Map *map, uint8_t *ctrl, MapEntry *list, size_t listsize) {
+    for (size_t i = 0; i < listsize; ++i)
+        if (IS_FULL(ctrl[i]))
+            insert(map, list[i].hash, list[i].key, list[i].value);
+    free(list);
+}
+
+// allocates listsize empty slots with their control bytes behind them, in one block
+static MapEntry *slots_alloc(size_t listsize, uint8_t **ctrl) {
+    MapEntry *list = (MapEntry *)malloc((sizeof(MapEntry) + 1) * listsize);
+    if (list == NULL)
+        return NULL;
+    *ctrl = (uint8_t *)(list + listsize);
+    memset(*ctrl, CTRL_EMPTY, listsize);
+    return list;
+}
 
-    free(tmplist);
+// switches to newlistsize fresh slots. the pairs are moved to them by later
+// operations, unless pairs of a previous resize are still waiting to be moved:
+// then all of them are moved right away
+static int reset_hashmap(Map *map, size_t newlistsize) {
+    if (newlistsize < MIN_LIST_SIZE)
+        newlistsize = MIN_LIST_SIZE;
+    if (MAX_LOAD(map, newlistsize) <= map->size)
+        return 1;
+
+    uint8_t *newctrl;
+    MapEntry *newlist = slots_alloc(newlistsize, &newctrl);
     if (newlist == NULL)
         return 1;
+
+    uint8_t *ctrl = map->ctrl;
+    MapEntry *list = map->list;
+    size_t listsize = map->list_size;
+    map->ctrl = newctrl;
+    map->list = newlist;
+    map->list_size = newlistsize;
+    map->growth_left = MAX_LOAD(map, newlistsize);
+    if (map->oldlist != NULL) {
+        move_all(map, map->oldctrl, map->oldlist, map->old_list_size);
+        move_all(map, ctrl, list, listsize);
+        map->oldctrl = NULL;
+        map->oldlist = NULL;
+        map->old_list_size = 0;
+        map->old_size = 0;
+    } else if (map->size == 0) {
+        free(list);
+    } else {
+        map->oldctrl = ctrl;
+        map->oldlist = list;
+        map->old_list_size = listsize;
+        map->old_size = map->size;
+    }
+    map->migrated = 0;
     return 0;
 }
 
-static int df_put(Map *map, void *key, void *value) {
-    // scatter v-k pairs by incrementing max index
-    if (map->auto_assign && map->size >= map->list_size)
-        if (reset_hashmap(map, map->list_size * 2) != 0)
-            return 1;
-
-    size_t index = map->hashcode(map, key);
-    if (map->list[index].key == NULL) {
-        // if no such key
-        ++map->size;
-        map->list[index].key = key;
-        map->list[index].value = value;
-    } else {
+// puts a pair whose key hashes to hash
+static int put_hashed(Map *map, void *key, void *value, size_t hash) {
+    size_t index;
+    bool old;
+    MapEntry *entry = find(map, key, hash, &index, &old);
+    if (entry != NULL) {
         // existing key
-        MapEntry *curr = &map->list[index];
-        while (curr != NULL) {
-            if (map->k_equal(key, curr->key)) {
-                curr->value = value;
-                return 0;
-            }
-            curr = curr->next;
-        }
-        // name collision!
-        MapEntry *newentry = NEW(MapEntry, 1);
-        if (newentry == NULL)
+        entry->value = value;
+        return 0;
+    }
+
+    // the pairs waiting to be moved keep their room. they run out of it only if puts
+    // come while an iterator holds them back; then they are moved all at once
+    if (map->growth_left <= map->old_size && map->oldlist != NULL && map->iterators == 0)
+        migrate(map, (size_t)-1);
+    if (map->growth_left <= map->old_size) {
+        // when deleted slots take most of the room, rehashing at the same size is enough
+        bool tombstones = map->size < MAX_LOAD(map, map->list_size) / 2;
+        if (!map->auto_assign && (!tombstones || map->oldlist != NULL))
+            return 1;
+        if (reset_hashmap(map, tombstones ? map->list_size : map->list_size * 2) != 0)
             return 1;
-        ++map->size;
-        newentry->key = key;
-        newentry->value = value;
-        newentry->next = map->list[index].next;
-        map->list[index].next = newentry;
     }
+    insert(map, hash, key, value);
+    ++map->size;
     return 0;
 }
 
+static int df_put(Map *map, void *key, void *value) {
+    migrate_step(map);
+    return put_hashed(map, key, value, map_hash(map, key));
+}
+
+static void *get_hashed(Map *map, void *key, size_t hash) {
+    size_t index;
+    bool old;
+    MapEntry *entry = find(map, key, hash, &index, &old);
+    return entry == NULL ? NULL : entry->value;
+}
+
 static void *df_get(Map *map, void *key) {
-    size_t index = map->hashcode(map, key);
-    MapEntry *entry = &map->list[index];
-    while (entry->key != NULL && !map->k_equal(key, entry->key))
-        entry = entry->next;
-    return entry->value;
+    migrate_step(map);
+    return get_hashed(map, key, map_hash(map, key));
+}
+
+// keys handled together by the batch functions
+#define BATCH 16
+
+// hashes keys and brings the slots they will probe first into the cache. the control
+// bytes are fetched first; once they are in, the slots of the first matches follow
+static void prefetch_batch(Map *map, void **keys, size_t *hashes, size_t n) {
+    size_t gmask = map->list_size / GROUP_WIDTH - 1;
+    for (size_t i = 0; i < n; ++i) {
+        hashes[i] = map_hash(map, keys[i]);
+        __builtin_prefetch(map->ctrl + (H1(hashes[i]) & gmask) * GROUP_WIDTH);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        size_t g = H1(hashes[i]) & gmask;
+        groupmask m = group_match(map->ctrl + g * GROUP_WIDTH, H2(hashes[i]));
+        __builtin_prefetch(&map->list[g * GROUP_WIDTH + (m != 0 ? MASK_LANE(m) : 0)]);
+    }
+}
+
+void map_get_batch(Map *map, void **keys, void **values, size_t n) {
+    if (map->snapshot != NULL) {
+        // no slots to prefetch
+        for (size_t i = 0; i < n; ++i)
+            values[i] = map->get(map, keys[i]);
+        return;
+    }
+    size_t hashes[BATCH];
+    for (size_t start = 0; start < n; start += BATCH) {
+        size_t len = n - start < BATCH ? n - start : BATCH;
+        migrate_step(map);
+        prefetch_batch(map, keys + start, hashes, len);
+        for (size_t i = 0; i < len; ++i)
+            values[start + i] = get_hashed(map, keys[start + i], hashes[i]);
+    }
+}
+
+int map_put_batch(Map *map, void **keys, void **values, size_t n) {
+    if (map->snapshot != NULL)
+        return 1;
+    size_t hashes[BATCH];
+    for (size_t start = 0; start < n; start += BATCH) {
+        size_t len = n - start < BATCH ? n - start : BATCH;
+        migrate_step(map);
+        prefetch_batch(map, keys + start, hashes, len);
+        // a resize in the middle only makes the rest of the prefetches useless
+        for (size_t i = 0; i < len; ++i)
+            if (put_hashed(map, keys[start + i], values[start + i], hashes[i]) != 0)
+                return 1;
+    }
+    return 0;
 }
 
 static void df_remove(Map *map, void *key) {
-    size_t index = map->hashcode(map, key);
-    MapEntry *entry = &map->list[index];
+    migrate_step(map);
+    size_t index;
+    bool old;
+    MapEntry *entry = find(map, key, map_hash(map, key), &index, &old);
     if (entry == NULL)
         return;
 
-    bool res = false;
-    if (map->k_equal(key, entry->key)) {
-        --map->size;
-        if (entry->next != NULL) {
-            MapEntry *tmp = entry->next;
-            entry->key = tmp->key;
-            entry->value = tmp->value;
-            entry->next = tmp->next;
-            free(tmp);
-        } else {
-            entry->key = NULL;
-            entry->value = NULL;
-        }
-        res = true;
+    --map->size;
+    entry->key = NULL;
+    entry->value = NULL;
+    if (old) {
+        // nothing is put in the old slots anymore
+        map->oldctrl[index] = CTRL_DELETED;
+        --map->old_size;
+    } else if (group_match_empty(map->ctrl + index / GROUP_WIDTH * GROUP_WIDTH) != 0) {
+        // a slot can become empty again only if no probe ever went past its group
+        map->ctrl[index] = CTRL_EMPTY;
+        ++map->growth_left;
     } else {
-        MapEntry *prev = entry;
-        entry = entry->next;
-        while (entry != NULL) {
-            if (map->k_equal(key, entry->key)) {
-                --map->size;
-                prev->next = entry->next;
-                free(entry);
-                res = true;
-                break;
-            }
-            prev = entry;
-            entry = entry->next;
-        }
+        map->ctrl[index] = CTRL_DELETED;
     }
 
-    // shirnk size if half of list is not occupied
-    if (res && map->auto_assign && map->size < map->list_size / 2)
+    // shrink size if the load falls under the minimum
+    if (map->auto_assign && map->oldlist == NULL && map->list_size > MIN_LIST_SIZE
+        && map->size < (size_t)(map->list_size * (double)map->min_load))
         (void)reset_hashmap(map, map->list_size / 2);
 }
 
 static bool df_exists(Map *map, void *key) {
-    size_t index = map->hashcode(map, key);
-    MapEntry *entry = &map->list[index];
-    if (entry->key == NULL)
-        return false;
-    if (map->k_equal(map, entry->key))
-        return true;
-    entry = entry->next;
-    while (entry != NULL) {
-        if (map->k_equal(map, entry->key))
-            return true;
-        entry = entry->next;
-    }
-    return false;
+    migrate_step(map);
+    size_t index;
+    bool old;
+    return find(map, key, map_hash(map, key), &index, &old) != NULL;
 }
 
 static void df_clear(Map *map) {
-    // free conflict lists
-    for (size_t i = 0; i < map->list_size; ++i) {
-        MapEntry *entry = map->list[i].next;
-        while (entry != NULL) {
-            MapEntry *next = entry->next;
-            free(entry);
-            entry = next;
-        }
-        map->list[i].next = NULL;
-    }
-    // free store (first level MapEntry)
-    free(map->list);
-    map->list = NULL;
+    // the slots are kept for the next pairs; old slots of an unfinished resize are freed
+    free(map->oldlist);
+    map->oldctrl = NULL;
+    map->oldlist = NULL;
+    map->old_list_size = 0;
+    map->old_size = 0;
+    map->migrated = 0;
+    if (map->list != NULL)
+        memset(map->ctrl, CTRL_EMPTY, map->list_size);
     map->size = 0;
-    map->list_size = 0;
+    map->growth_left = MAX_LOAD(map, map->list_size);
 }
 
 static void df_free(Map *map) {
     map->clear(map);
+    free(map->list);
     free(map);
 }
 
@@ -205,18 +508,25 @@ Map *createHashMap(hashcode_func hashcode, key_equal_func k_equal) {
     Map *map = NEW(Map, 1);
     if (map == NULL)
         return NULL;
-    MapEntry *list = NEW(MapEntry, 8);
-    if (list == NULL) {
+    map->size = 0;
+    map->list_size = 0;
+    map->ctrl = NULL;
+    map->list = NULL;
+    map->oldctrl = NULL;
+    map->oldlist = NULL;
+    map->old_list_size = 0;
+    map->old_size = 0;
+    map->migrated = 0;
+    map->iterators = 0;
+    map->snapshot = NULL;
+    map->max_load = DF_MAX_LOAD;
+    map->min_load = DF_MIN_LOAD;
+    map->hashcode = hashcode == NULL ? df_hashcode : hashcode;
+    if (reset_hashmap(map, MIN_LIST_SIZE) != 0) {
         free(map);
         return NULL;
     }
-    for (size_t i = 0; i < 8; ++i)
-        memset(&list[i], 0, sizeof(MapEntry));
-    map->size = 0;
-    map->list_size = 8;
     map->auto_assign = true;
-    map->list = list;
-    map->hashcode = hashcode == NULL ? df_hashcode : hashcode;
     map->k_equal = k_equal == NULL ? df_k_equal : k_equal;
     map->put = df_put;
     map->get = df_get;
@@ -227,47 +537,533 @@ Map *createHashMap(hashcode_func hashcode, key_equal_func k_equal) {
     return map;
 }
 
+// returns the least number of slots in which n pairs fit without growing
+static size_t list_size_for(Map *map, size_t n) {
+    size_t listsize = MIN_LIST_SIZE;
+    while (MAX_LOAD(map, listsize) <= n)
+        listsize *= 2;
+    return listsize;
+}
+
+// resizes to newlistsize slots and moves every pair right away
+static int resize_now(Map *map, size_t newlistsize) {
+    if (reset_hashmap(map, newlistsize) != 0)
+        return 1;
+    if (map->oldlist != NULL)
+        migrate(map, (size_t)-1);
+    return 0;
+}
+
+int map_reserve(Map *map, size_t n) {
+    if (map->snapshot != NULL)
+        return 1;
+    size_t listsize = list_size_for(map, n);
+    if (listsize < map->list_size)
+        listsize = map->list_size;
+    // fits already, counting the deleted slots
+    if (listsize == map->list_size && map->oldlist == NULL && map->growth_left >= n - (n < map->size ? n : map->size))
+        return 0;
+    return resize_now(map, listsize);
+}
+
+int map_shrink_to_fit(Map *map) {
+    if (map->snapshot != NULL)
+        return 1;
+    size_t listsize = list_size_for(map, map->size);
+    if (listsize >= map->list_size && map->oldlist == NULL)
+        return 0;
+    return resize_now(map, listsize);
+}
+
+int map_set_load_factors(Map *map, float max_load, float min_load) {
+    if (map->snapshot != NULL)
+        return 1;
+    if (!(max_load >= MIN_MAX_LOAD && max_load <= MAX_MAX_LOAD && min_load >= 0
+          && min_load <= max_load / 2.0 - 1.0 / (GROUP_WIDTH * MIGRATE_GROUPS)))
+        return 1;
+    // a resize is finished first, so that its pairs never end up over the new limit
+    if (map->oldlist != NULL && map->iterators == 0)
+        migrate(map, (size_t)-1);
+    // slots taken by full or deleted ones stay taken
+    size_t used = MAX_LOAD(map, map->list_size) - map->growth_left;
+    size_t limit = (size_t)(map->list_size * (double)max_load);
+    if (used + map->old_size > limit && map->old_size != 0)
+        return 1;
+    map->max_load = max_load;
+    map->min_load = min_load;
+    map->growth_left = used < limit ? limit - used : 0;
+    return 0;
+}
+
+// pairs under which map_build_parallel() is not worth starting threads for
+#define PARALLEL_MIN_PAIRS 4096
+
+// the work of one thread of map_build_parallel(). the slots are split into nparts
+// runs of groups, and each thread puts the pairs whose first group is in its run
+typedef struct {
+    Map *map;
+    void **keys;
+    void **values;
+    size_t *hashes;          // hash of every key
+    size_t *order;           // indices of the keys, sorted by part
+    size_t *offs;            // keys of each chunk per part, then where they go in order
+    size_t *bounds;          // where each part starts in order, and where the last one ends
+    size_t nparts;
+    size_t part;             // chunk of keys to hash, then part of the slots to fill
+    size_t n;
+    size_t deferred;         // keys left at the start of the part in order, to put after
+    size_t size;             // pairs put
+    size_t taken;            // empty slots taken
+    pthread_t tid;
+    bool started;            // whether tid runs it
+} BuildWork;
+
+static inline size_t part_of(size_t hash, size_t ngroups, size_t nparts) {
+    return (H1(hash) & (ngroups - 1)) * nparts / ngroups;
+}
+
+// hashes a chunk of the keys, counting them by part
+static void *build_hash(void *arg) {
+    BuildWork *w = (BuildWork *)arg;
+    size_t ngroups = w->map->list_size / GROUP_WIDTH;
+    size_t *counts = w->offs + w->part * w->nparts;
+    for (size_t i = w->n * w->part / w->nparts; i < w->n * (w->part + 1) / w->nparts; ++i) {
+        w->hashes[i] = map_hash(w->map, w->keys[i]);
+        ++counts[part_of(w->hashes[i], ngroups, w->nparts)];
+    }
+    return NULL;
+}
+
+// writes the indices of a chunk where its keys of each part go. chunks follow each
+// other within a part, so the keys of a part keep their order
+static void *build_scatter(void *arg) {
+    BuildWork *w = (BuildWork *)arg;
+    size_t ngroups = w->map->list_size / GROUP_WIDTH;
+    size_t *offs = w->offs + w->part * w->nparts;
+    for (size_t i = w->n * w->part / w->nparts; i < w->n * (w->part + 1) / w->nparts; ++i)
+        w->order[offs[part_of(w->hashes[i], ngroups, w->nparts)]++] = i;
+    return NULL;
+}
+
+// puts the keys of a part into its groups. a key whose probe sequence leaves them
+// before it is found or placed is deferred, since the thread of the other groups may
+// be writing them. a later duplicate of a key follows the same probe sequence, so it
+// finds the key or is deferred too
+static void *build_fill(void *arg) {
+    BuildWork *w = (BuildWork *)arg;
+    Map *map = w->map;
+    size_t ngroups = map->list_size / GROUP_WIDTH, gmask = ngroups - 1;
+    size_t start = w->bounds[w->part];
+    for (size_t k = start; k < w->bounds[w->part + 1]; ++k) {
+        size_t i = w->order[k], hash = w->hashes[i];
+        size_t g = H1(hash) & gmask, index = map->list_size;
+        bool found = false, deferred = false;
+        for (size_t step = 1; !found; ++step) {
+            uint8_t *ctrl = map->ctrl + g * GROUP_WIDTH;
+            for (groupmask m = group_match(ctrl, H2(hash)); m != 0 && !found; m &= m - 1) {
+                size_t j = g * GROUP_WIDTH + MASK_LANE(m);
+                if (map->list[j].hash == hash && map->k_equal(w->keys[i], map->list[j].key)) {
+                    map->list[j].value = w->values[i];
+                    found = true;
+                }
+            }
+            groupmask m = group_match_free(ctrl);
+            if (index == map->list_size && m != 0)
+                index = g * GROUP_WIDTH + MASK_LANE(m);
+            if (found || group_match_empty(ctrl) != 0)
+                break;
+            g = (g + step) & gmask;
+            if (g * w->nparts / ngroups != w->part) {
+                deferred = true;
+                break;
+            }
+        }
+        if (found)
+            continue;
+        if (deferred) {
+            w->order[start + w->deferred++] = i;
+            continue;
+        }
+        if (map->ctrl[index] == CTRL_EMPTY)
+            ++w->taken;
+        ++w->size;
+        map->ctrl[index] = H2(hash);
+        map->list[index].key = w->keys[i];
+        map->list[index].value = w->values[i];
+        map->list[index].hash = hash;
+    }
+    return NULL;
+}
+
+// runs fn on every work, each on a thread of its own. the first one, and any whose
+// thread cannot be started, run on the calling thread
+static void run_parallel(void *(*fn)(void *), BuildWork *works, size_t nworks) {
+    for (size_t t = 1; t < nworks; ++t)
+        works[t].started = pthread_create(&works[t].tid, NULL, fn, &works[t]) == 0;
+    fn(&works[0]);
+    for (size_t t = 1; t < nworks; ++t) {
+        if (works[t].started)
+            pthread_join(works[t].tid, NULL);
+        else
+            fn(&works[t]);
+    }
+}
+
+int map_build_parallel(Map *map, void **keys, void **values, size_t n, int threads) {
+    if (map->snapshot != NULL)
+        return 1;
+    if (map_reserve(map, map->size + n) != 0)
+        return 1;
+    size_t ngroups = map->list_size / GROUP_WIDTH;
+    size_t nparts = threads > 0 ? (size_t)threads : 1;
+    if (nparts > ngroups)
+        nparts = ngroups;
+    if (map->size != 0 || nparts < 2 || n < PARALLEL_MIN_PAIRS)
+        return map_put_batch(map, keys, values, n);
+
+    size_t *hashes = NEW(size_t, n);
+    size_t *order = NEW(size_t, n);
+    size_t *offs = (size_t *)calloc(nparts * nparts, sizeof(size_t));
+    size_t *bounds = NEW(size_t, (nparts + 1));
+    BuildWork *works = NEW(BuildWork, nparts);
+    if (hashes == NULL || order == NULL || offs == NULL || bounds == NULL || works == NULL) {
+        free(hashes);
+        free(order);
+        free(offs);
+        free(bounds);
+        free(works);
+        return map_put_batch(map, keys, values, n);
+    }
+    for (size_t t = 0; t < nparts; ++t)
+        works[t] = (BuildWork){ .map = map, .keys = keys, .values = values, .hashes = hashes, .order = order,
+                                .offs = offs, .bounds = bounds, .nparts = nparts, .part = t, .n = n };
+
+    run_parallel(build_hash, works, nparts);
+    // the counts become offsets: parts one after another, chunks in order within each
+    size_t off = 0;
+    for (size_t r = 0; r < nparts; ++r) {
+        bounds[r] = off;
+        for (size_t t = 0; t < nparts; ++t) {
+            size_t count = offs[t * nparts + r];
+            offs[t * nparts + r] = off;
+            off += count;
+        }
+    }
+    bounds[nparts] = off;
+    run_parallel(build_scatter, works, nparts);
+    run_parallel(build_fill, works, nparts);
+
+    // then the deferred keys, which may probe any part
+    for (size_t r = 0; r < nparts; ++r) {
+        map->size += works[r].size;
+        map->growth_left -= works[r].taken;
+    }
+    int res = 0;
+    for (size_t r = 0; r < nparts && res == 0; ++r) {
+        for (size_t k = bounds[r]; k < bounds[r] + works[r].deferred && res == 0; ++k)
+            res = put_hashed(map, keys[order[k]], values[order[k]], hashes[order[k]]);
+    }
+    free(hashes);
+    free(order);
+    free(offs);
+    free(bounds);
+    free(works);
+    return res;
+}
+
+// returns slot i, counting the old slots first, or NULL if it has no pair
+static inline MapEntry *full_slot(Map *map, size_t i) {
+    if (i < map->old_list_size)
+        return IS_FULL(map->oldctrl[i]) ? &map->oldlist[i] : NULL;
+    i -= map->old_list_size;
+    return IS_FULL(map->ctrl[i]) ? &map->list[i] : NULL;
+}
+
 static bool mapiter_has_next(MapIterator *it) {
-    return it->count < it->map->size;
+    // snapshots have pairs but no slots to walk
+    return it->count < it->map->size && it->hashcode + 1 < it->map->old_list_size + it->map->list_size;
 }
 
 static MapIterator *mapiter_next(MapIterator *it) {
+    Map *map = it->map;
     if (it->has_next(it)) {
-        // collision
-        if (it->curr != NULL && it->curr->next != NULL) {
+        while (++it->hashcode < map->old_list_size + map->list_size) {
+            MapEntry *entry = full_slot(map, it->hashcode);
+            if (entry == NULL)
+                continue;
             ++it->count;
-            it->curr = it->curr->next;
-            return it;
-        }
-        // different key hashcode
-        while (++it->hashcode < it->map->list_size) {
-            MapEntry *entry = &it->map->list[it->hashcode];
-            if (entry->key != NULL) {
-                ++it->count;
-                it->curr = entry;
-                break;
-            }
+            it->curr = entry;
+            break;
         }
     }
     return it;
 }
 
+// the slot of the next pair of a range iterator, or its end
+static size_t rangeiter_peek(MapIterator *it) {
+    size_t i = it->hashcode + 1;
+    while (i < it->end && full_slot(it->map, i) == NULL)
+        ++i;
+    return i;
+}
+
+static bool rangeiter_has_next(MapIterator *it) {
+    return rangeiter_peek(it) < it->end;
+}
+
+static MapIterator *rangeiter_next(MapIterator *it) {
+    size_t i = rangeiter_peek(it);
+    if (i < it->end) {
+        it->hashcode = i;
+        it->curr = full_slot(it->map, i);
+        ++it->count;
+    }
+    return it;
+}
+
+static void rangeiter_end(MapIterator *it) {
+    (void)it;
+}
+
+// ends an iterator made by initHashMapIterator()
+static void mapiter_end(MapIterator *it) {
+    --it->map->iterators;
+}
+
 static void mapiter_free(MapIterator *it) {
+    mapiter_end(it);
     free(it);
 }
 
-MapIterator *createHashMapIterator(Map *map) {
-    MapIterator *it = NEW(MapIterator, 1);
-    if (it == NULL)
-        return NULL;
+void initHashMapIterator(MapIterator *it, Map *map) {
+    ++map->iterators;
     it->map = map;
     it->curr = NULL;
     it->count = 0;
     it->hashcode = (size_t)-1;
+    it->end = 0;
     it->has_next = mapiter_has_next;
     it->next = mapiter_next;
+    it->free = mapiter_end;
+}
+
+MapIterator *createHashMapIterator(Map *map) {
+    MapIterator *it = NEW(MapIterator, 1);
+    if (it == NULL)
+        return NULL;
+    initHashMapIterator(it, map);
     it->free = mapiter_free;
     return it;
 }
 
+void initHashMapRangeIterator(MapIterator *it, Map *map, size_t part, size_t nparts) {
+    size_t nslots = map->old_list_size + map->list_size;
+    it->map = map;
+    it->curr = NULL;
+    it->count = 0;
+    it->hashcode = nslots / nparts * part - 1;
+    it->end = part + 1 == nparts ? nslots : nslots / nparts * (part + 1);
+    it->has_next = rangeiter_has_next;
+    it->next = rangeiter_next;
+    it->free = rangeiter_end;
+}
+
+// snapshot files. all offsets are from the start of the file, and every integer is
+// in the byte order of the machine that wrote it
+#define SNAPSHOT_MAGIC "MAPSNAP1"
+
+typedef struct {
+    char magic[8];
+    uint64_t file_size;
+    uint64_t npairs;
+    uint64_t nslots;       // a power of two, at least GROUP_WIDTH
+    uint64_t ctrl_off;     // nslots control bytes, like the ones of a map
+    uint64_t slots_off;    // nslots SnapshotSlot
+} SnapshotHeader;
+
+typedef struct {
+    uint64_t hash;         // stringHashcode() of the key
+    uint64_t key_off;      // NUL-terminated key
+    uint64_t value_off;
+} SnapshotSlot;
+
+#define ALIGN8(N) (((N) + 7) & ~(uint64_t)7)
+
+static size_t df_value_size(void *value) {
+    return strlen((const char *)value) + 1;
+}
+
+int map_snapshot_write(Map *map, const char *path, size_t (*value_size)(void *value)) {
+    if (value_size == NULL)
+        value_size = df_value_size;
+    // at most half full, so that probes are short
+    uint64_t nslots = GROUP_WIDTH;
+    while (nslots < 2 * (uint64_t)map->size)
+        nslots *= 2;
+    uint8_t *ctrl = NEW(uint8_t, nslots);
+    SnapshotSlot *slots = NEW(SnapshotSlot, nslots);
+    if (ctrl == NULL || slots == NULL) {
+        free(ctrl);
+        free(slots);
+        return 1;
+    }
+    memset(ctrl, CTRL_EMPTY, nslots);
+
+    SnapshotHeader h;
+    memcpy(h.magic, SNAPSHOT_MAGIC, sizeof h.magic);
+    h.npairs = map->size;
+    h.nslots = nslots;
+    h.ctrl_off = sizeof h;
+    h.slots_off = ALIGN8(h.ctrl_off + nslots);
+
+    // place every pair; keys and values follow the slots in iteration order
+    uint64_t off = h.slots_off + nslots * sizeof(SnapshotSlot);
+    size_t gmask = nslots / GROUP_WIDTH - 1;
+    MapIterator it;
+    initHashMapIterator(&it, map);
+    while (it.has_next(&it)) {
+        it.next(&it);
+        size_t hash = stringHashcode((const char *)it.curr->key);
+        size_t g = H1(hash) & gmask;
+        groupmask m;
+        for (size_t step = 1; (m = group_match_free(ctrl + g * GROUP_WIDTH)) == 0; ++step)
+            g = (g + step) & gmask;
+        size_t i = g * GROUP_WIDTH + MASK_LANE(m);
+        ctrl[i] = H2(hash);
+        slots[i].hash = hash;
+        slots[i].key_off = off;
+        off = ALIGN8(off + strlen((const char *)it.curr->key) + 1);
+        slots[i].value_off = off;
+        off = ALIGN8(off + value_size(it.curr->value));
+    }
+    it.free(&it);
+    h.file_size = off;
 
+    FILE *f = fopen(path, "wb");
+    int res = f == NULL;
+    if (f != NULL) {
+        static const char zeros[8];
+        res |= fwrite(&h, sizeof h, 1, f) != 1;
+        res |= fwrite(ctrl, 1, nslots, f) != nslots;
+        res |= fwrite(zeros, 1, h.slots_off - h.ctrl_off - nslots, f) != h.slots_off - h.ctrl_off - nslots;
+        res |= fwrite(slots, sizeof(SnapshotSlot), nslots, f) != nslots;
+        // the same iteration order as above
+        initHashMapIterator(&it, map);
+        while (!res && it.has_next(&it)) {
+            it.next(&it);
+            size_t klen = strlen((const char *)it.curr->key) + 1, vlen = value_size(it.curr->value);
+            res |= fwrite(it.curr->key, 1, klen, f) != klen;
+            res |= fwrite(zeros, 1, ALIGN8(klen) - klen, f) != ALIGN8(klen) - klen;
+            res |= fwrite(it.curr->value, 1, vlen, f) != vlen;
+            res |= fwrite(zeros, 1, ALIGN8(vlen) - vlen, f) != ALIGN8(vlen) - vlen;
+        }
+        it.free(&it);
+        res |= fclose(f) != 0;
+    }
+    free(ctrl);
+    free(slots);
+    return res;
+}
+
+// returns the slot of key in a snapshot, or NULL. slots are only checked when they
+// are probed, so that opening a file stays free: offsets out of the file never match,
+// and a file without empty slots ends the probe after every group
+static const SnapshotSlot *snapshot_find(const SnapshotHeader *h, const char *key) {
+    const char *base = (const char *)h;
+    const uint8_t *ctrls = (const uint8_t *)(base + h->ctrl_off);
+    const SnapshotSlot *slots = (const SnapshotSlot *)(base + h->slots_off);
+    size_t hash = stringHashcode(key);
+    size_t klen = strlen(key) + 1;
+    size_t ngroups = h->nslots / GROUP_WIDTH;
+    size_t g = H1(hash) & (ngroups - 1);
+    for (size_t step = 1; step <= ngroups; ++step) {
+        const uint8_t *ctrl = ctrls + g * GROUP_WIDTH;
+        for (groupmask m = group_match(ctrl, H2(hash)); m != 0; m &= m - 1) {
+            const SnapshotSlot *slot = &slots[g * GROUP_WIDTH + MASK_LANE(m)];
+            // the key compares its own NUL, so a match is terminated inside the file
+            if (slot->hash == hash && slot->key_off <= h->file_size
+                && klen <= h->file_size - slot->key_off && slot->value_off < h->file_size
+                && memcmp(key, base + slot->key_off, klen) == 0)
+                return slot;
+        }
+        if (group_match_empty(ctrl) != 0)
+            return NULL;
+        g = (g + step) & (ngroups - 1);
+    }
+    return NULL;
+}
+
+static void *snapshot_get(Map *map, void *key) {
+    const SnapshotSlot *slot = snapshot_find((const SnapshotHeader *)map->snapshot, (const char *)key);
+    return slot == NULL ? NULL : (char *)map->snapshot + slot->value_off;
+}
+
+static bool snapshot_exists(Map *map, void *key) {
+    return snapshot_find((const SnapshotHeader *)map->snapshot, (const char *)key) != NULL;
+}
+
+static int snapshot_put(Map *map, void *key, void *value) {
+    (void)map;
+    (void)key;
+    (void)value;
+    return 1;
+}
+
+static void snapshot_remove(Map *map, void *key) {
+    (void)map;
+    (void)key;
+}
+
+static void snapshot_clear(Map *map) {
+    (void)map;
+}
+
+static void snapshot_free(Map *map) {
+    munmap(map->snapshot, ((const SnapshotHeader *)map->snapshot)->file_size);
+    free(map);
+}
+
+// checks that the header describes a file of size bytes
+static bool snapshot_valid(const SnapshotHeader *h, size_t size) {
+    if (size < sizeof *h || memcmp(h->magic, SNAPSHOT_MAGIC, sizeof h->magic) != 0 || h->file_size != size)
+        return false;
+    if (h->nslots < GROUP_WIDTH || (h->nslots & (h->nslots - 1)) != 0 || h->npairs >= h->nslots
+        || h->nslots > size)
+        return false;
+    // compared so that nothing overflows
+    return h->ctrl_off >= sizeof *h && h->ctrl_off <= h->slots_off && h->slots_off <= size
+        && h->nslots <= h->slots_off - h->ctrl_off && h->slots_off % 8 == 0
+        && h->nslots <= (size - h->slots_off) / sizeof(SnapshotSlot);
+}
+
+Map *openHashMapSnapshot(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return NULL;
+    struct stat st;
+    void *mem = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        mem = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return NULL;
+    Map *map = NEW(Map, 1);
+    if (map == NULL || !snapshot_valid((const SnapshotHeader *)mem, (size_t)st.st_size)) {
+        munmap(mem, (size_t)st.st_size);
+        free(map);
+        return NULL;
+    }
+
+    memset(map, 0, sizeof *map);
+    map->size = ((const SnapshotHeader *)mem)->npairs;
+    map->snapshot = mem;
+    map->hashcode = df_hashcode;
+    map->k_equal = df_k_equal;
+    map->put = snapshot_put;
+    map->get = snapshot_get;
+    map->remove = snapshot_remove;
+    map->exists = snapshot_exists;
+    map->clear = snapshot_clear;
+    map->free = snapshot_free;
+    return map;
+}
@@ -2,6 +2,7 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -9,30 +10,48 @@ extern "C" {
 
 struct Map;
 
+// returns a hash of key. the map reduces it to a slot itself, so it may span all
+// bits of size_t. hashes are cached in the slots and kept across resizes, so the
+// hash must depend only on the key: it must never read the map, e.g. its list_size
 typedef size_t (*hashcode_func)(struct Map *map, void *key);
 typedef bool (*key_equal_func)(void *key1, void *key2);
 
-// a key-value pair with same hashcode id. pairs with same hashcode
-// are linked
+// a slot of the table, holding a key-value pair if its control byte says so
 typedef struct MapEntry {
     void *key;
     void *value;
-    struct MapEntry *next; // linked list for conflict keys, may be NULL
+    size_t hash;           // hash of key, so that it is never computed again
 } MapEntry;
 
-// hashmap
+// hashmap with open addressing. every slot has a control byte, that is empty, deleted,
+// or 7 bits of the hash of its key. lookups compare the control bytes of 16 slots
+// at once and call k_equal only on slots whose whole hash matches.
+// resizing is incremental: the old slots are kept, and each put, get, remove and
+// exists moves a few groups of them to the new slots until none is left
 typedef struct Map {
     size_t size;           // current k-v pairs
-    size_t list_size;      // current max array size
-    bool auto_assign;      // aynamic allocate memory?
-    MapEntry *list;        // store. first level MapEntry must exist
+    size_t list_size;      // number of slots, a power of two
+    bool auto_assign;      // aynamic allocate memory? if false, the capacity is pinned and put
+                           // fails when no slot is left
+    float max_load;        // load factors that make it grow and shrink, set them with
+    float min_load;        // map_set_load_factors()
+    MapEntry *list;        // slots
+    uint8_t *ctrl;         // control bytes of the slots, allocated behind them
+    size_t growth_left;    // empty slots that can be taken before it has to grow
+    MapEntry *oldlist;     // slots before the last resize, NULL once all pairs are moved
+    uint8_t *oldctrl;
+    size_t old_list_size;
+    size_t old_size;       // pairs in the old slots; growth_left always leaves room for them
+    size_t migrated;       // groups of the old slots that are moved
+    int iterators;         // open iterators; pairs are not moved while there are any
+    void *snapshot;        // mapped file of a map from openHashMapSnapshot(), else NULL
     hashcode_func hashcode;                              // hashcode function
     key_equal_func k_equal;                              // checks whether two keys are equal
     int (*put)(struct Map *map, void *key, void *value); // add k and v
     void *(*get)(struct Map *map, void *key);            // gets k
     void (*remove)(struct Map *map, void *key);          // remove k
     bool (*exists)(struct Map *map, void *key);          // checks if key exists
-    void (*clear)(struct Map *map);                      // clears all keys
+    void (*clear)(struct Map *map);                      // clears all keys, keeping the slots
     void (*free)(struct Map *map);                       // free the map, not key/values if they are from malloc
 } Map;
 
@@ -40,19 +59,89 @@ typedef struct MapIterator {
     Map *map;
     MapEntry *curr;        // current k-v pair
     size_t count;          // nth iteration
-    size_t hashcode;       // hashcode of curr
+    size_t hashcode;       // slot of curr, counting the old slots first
+    size_t end;            // slot after the last one of a range iterator
     bool (*has_next)(struct MapIterator *it);            // has next element?
     struct MapIterator *(*next)(struct MapIterator *it); // advance to next pair and return current it
     void (*free)(struct MapIterator *it);
 } MapIterator;
 
+// the default hashcode of string keys, well mixed in all bits
+size_t stringHashcode(const char *key);
+
 // creates a new map with custom hashcode and equal functions.
 // default ones for string are used if they are NULL
 Map *createHashMap(hashcode_func hashcode, key_equal_func k_equal);
 
-// create an iterator of map
+// gets the values of n keys into values, NULL for missing keys. all keys of a batch
+// are hashed and their slots prefetched before any is probed, so that the cache
+// misses of big maps overlap
+void map_get_batch(Map *map, void **keys, void **values, size_t n);
+
+// puts n pairs like map_get_batch() gets them. 1 is returned if one fails; the pairs
+// before it are put
+int map_put_batch(Map *map, void **keys, void **values, size_t n);
+
+// puts n pairs like map_put_batch(), on up to threads threads. the keys are hashed
+// in parallel, then each thread fills a disjoint run of slot groups with the keys
+// whose hash falls into it; the few whose probes run into another thread's groups
+// are put afterwards. hashcode and k_equal are called from all the threads at once.
+// room for n pairs is reserved first, which resizes right away. an empty map is
+// needed for the parallel part; pairs are put one by one into any other, and when
+// n is small. 2 size_t per pair are allocated while it runs; build with -pthread
+// 1 is returned if this fails
+int map_build_parallel(Map *map, void **keys, void **values, size_t n, int threads);
+
+// makes room for n pairs, so that it does not grow until there are more. this is
+// done right away, even if auto_assign is false
+// 1 is returned if this fails
+int map_reserve(Map *map, size_t n);
+
+// resizes to the least number of slots that fit the current pairs, right away
+// 1 is returned if this fails
+int map_shrink_to_fit(Map *map);
+
+// sets the load factors: the map grows when pairs and deleted slots take more than
+// max_load of the slots, and shrinks when pairs take less than min_load. the
+// defaults are 0.875 and 0.25. max_load must be from 0.0625 to 0.9375, and min_load at
+// most half of max_load less 1/32, so that a resize never takes the load across the
+// other bound, and the pairs put while a shrink is moving the old ones fit. 0 as
+// min_load means never shrink
+// 1 is returned if they are invalid, or if an iterator is open during a resize and
+// the pairs still to be moved would not fit under max_load
+int map_set_load_factors(Map *map, float max_load, float min_load);
+
+// writes the pairs of a map with string keys into a file at path, which can be
+// opened with openHashMapSnapshot(). value_size(value) gives the number of bytes of
+// each value to store; if it is NULL, values are strings too
+// 1 is returned if this fails
+int map_snapshot_write(Map *map, const char *path, size_t (*value_size)(void *value));
+
+// maps a file written by map_snapshot_write() into memory, and returns a read-only
+// map of it. nothing is parsed or copied: get and exists probe the file directly and
+// return pointers into it. put fails, remove and clear do nothing, and it cannot be
+// iterated. map_get_batch() gets the keys one by one; map_put_batch(),
+// map_build_parallel(), map_reserve(), map_shrink_to_fit() and map_set_load_factors()
+// fail. free unmaps the file. the file must come from a machine of the same byte
+// order
+// NULL is returned if this fails or the file is not a snapshot
+Map *openHashMapSnapshot(const char *path);
+
+// create an iterator of map. changing values while iterating is fine, putting or
+// removing keys may make it skip or repeat pairs
 MapIterator *createHashMapIterator(Map *map);
 
+// initializes an iterator in caller storage, e.g. on the stack, so that iterating
+// allocates nothing. it->free(it) must still be called to end it
+void initHashMapIterator(MapIterator *it, Map *map);
+
+// initializes an iterator of part of nparts disjoint ranges of the slots, so that
+// each of nparts threads can scan its own range at the same time. unlike other
+// iterators, these do not keep pairs from moving: nothing may use the map while
+// they are in use, not even get, which moves pairs during a resize. it->free(it)
+// does nothing but may still be called
+void initHashMapRangeIterator(MapIterator *it, Map *map, size_t part, size_t nparts);
+
 #ifdef __cplusplus
 }
 #endif
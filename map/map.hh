@@ -0,0 +1,318 @@
+// requires -std=c++17 or above
+// typed counterpart of map.h: keys and values are stored inline in the slots, and
+// hashing and comparing are inlined instead of called through function pointers
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON)
+    #include <arm_neon.h>
+#endif
+
+namespace oneesama {
+
+    namespace detail {
+        // a group of 16 control bytes, with the same layout as the ones of map.c
+        struct ctrl_group {
+            static constexpr std::size_t width = 16;
+            static constexpr std::uint8_t empty = 0x80;
+            static constexpr std::uint8_t deleted = 0xFE;
+
+            // slots whose control byte is h2; the lowest one is lane(m), m &= m - 1 drops it
+#if defined(__SSE2__)
+            using mask = std::uint32_t;
+            static constexpr int lane_shift = 0;
+
+            static mask match(const std::uint8_t *g, std::uint8_t h2) {
+                auto ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(g));
+                return static_cast<mask>(_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(static_cast<char>(h2)))));
+            }
+            static mask match_free(const std::uint8_t *g) {
+                return static_cast<mask>(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(g))));
+            }
+#elif defined(__ARM_NEON)
+            using mask = std::uint64_t;
+            static constexpr int lane_shift = 2;
+
+            static mask neon_mask(uint8x16_t eq) {
+                auto nibbles = vshrn_n_u16(vreinterpretq_u16_u8(eq), 4);
+                return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) & 0x8888888888888888ULL;
+            }
+            static mask match(const std::uint8_t *g, std::uint8_t h2) {
+                return neon_mask(vceqq_u8(vld1q_u8(g), vdupq_n_u8(h2)));
+            }
+            static mask match_free(const std::uint8_t *g) {
+                return neon_mask(vtstq_u8(vld1q_u8(g), vdupq_n_u8(0x80)));
+            }
+#else
+            using mask = std::uint32_t;
+            static constexpr int lane_shift = 0;
+
+            static mask match(const std::uint8_t *g, std::uint8_t h2) {
+                mask m = 0;
+                for (std::size_t i = 0; i < width; ++i) m |= static_cast<mask>(g[i] == h2) << i;
+                return m;
+            }
+            static mask match_free(const std::uint8_t *g) {
+                mask m = 0;
+                for (std::size_t i = 0; i < width; ++i) m |= static_cast<mask>(g[i] >> 7) << i;
+                return m;
+            }
+#endif
+            static mask match_empty(const std::uint8_t *g) { return match(g, empty); }
+            static std::size_t lane(mask m) { return static_cast<std::size_t>(__builtin_ctzll(m)) >> lane_shift; }
+            static bool is_full(std::uint8_t c) { return (c & 0x80) == 0; }
+        };
+    }
+
+    // An open-addressing hashmap with the growth policy of map.h: it grows twice as large
+    // once 7/8 of the slots are taken, and shrinks by half when under a quarter is used.
+    // References to values stay valid until the next insertion or erasure. A moved-from
+    // map is empty and can be used again.
+    template<class K, class V, class Hash = std::hash<K>, class Eq = std::equal_to<K>>
+    class hash_map {
+    public:
+        struct entry {
+            K key;
+            V value;
+        };
+
+        template<bool Const>
+        class basic_iterator {
+        public:
+            using map_t = std::conditional_t<Const, const hash_map, hash_map>;
+            using reference = std::conditional_t<Const, const entry &, entry &>;
+
+            basic_iterator(map_t *map, std::size_t i) : map_{map}, i_{i} { skip(); }
+
+            reference operator*() const { return map_->slots_[i_]; }
+            auto operator->() const { return &map_->slots_[i_]; }
+            basic_iterator &operator++() {
+                ++i_;
+                skip();
+                return *this;
+            }
+            bool operator==(const basic_iterator &o) const { return i_ == o.i_; }
+            bool operator!=(const basic_iterator &o) const { return i_ != o.i_; }
+
+        private:
+            map_t *map_;
+            std::size_t i_;
+
+            void skip() {
+                while (i_ < map_->cap_ && !group::is_full(map_->ctrl_[i_])) ++i_;
+            }
+        };
+
+        using iterator = basic_iterator<false>;
+        using const_iterator = basic_iterator<true>;
+
+        explicit hash_map(Hash hash = Hash{}, Eq eq = Eq{}) : hash_{std::move(hash)}, eq_{std::move(eq)} {
+            rehash(min_capacity);
+        }
+
+        hash_map(const hash_map &) = delete;
+        hash_map &operator=(const hash_map &) = delete;
+
+        hash_map(hash_map &&o) noexcept
+            : hash_{std::move(o.hash_)}, eq_{std::move(o.eq_)}, slots_{std::exchange(o.slots_, nullptr)}
+            , ctrl_{std::exchange(o.ctrl_, nullptr)}, cap_{std::exchange(o.cap_, 0)}
+            , size_{std::exchange(o.size_, 0)}, growth_left_{std::exchange(o.growth_left_, 0)}
+        {}
+
+        hash_map &operator=(hash_map &&o) noexcept {
+            if (this != &o) {
+                destroy();
+                hash_ = std::move(o.hash_);
+                eq_ = std::move(o.eq_);
+                slots_ = std::exchange(o.slots_, nullptr);
+                ctrl_ = std::exchange(o.ctrl_, nullptr);
+                cap_ = std::exchange(o.cap_, 0);
+                size_ = std::exchange(o.size_, 0);
+                growth_left_ = std::exchange(o.growth_left_, 0);
+            }
+            return *this;
+        }
+
+        ~hash_map() { destroy(); }
+
+        std::size_t size() const { return size_; }
+        bool empty() const { return size_ == 0; }
+        std::size_t capacity() const { return cap_; }
+
+        iterator begin() { return {this, 0}; }
+        iterator end() { return {this, cap_}; }
+        const_iterator begin() const { return {this, 0}; }
+        const_iterator end() const { return {this, cap_}; }
+
+        // returns the value of key, or nullptr if it is not in the map
+        V *find(const K &key) {
+            auto i = find_index(key, hash_of(key));
+            return i == cap_ ? nullptr : &slots_[i].value;
+        }
+        const V *find(const K &key) const { return const_cast<hash_map *>(this)->find(key); }
+
+        bool contains(const K &key) const { return find(key) != nullptr; }
+
+        // puts the pair, or assigns value if key exists. returns true if key is new
+        template<class KK, class VV>
+        bool insert_or_assign(KK &&key, VV &&value) {
+            auto hash = hash_of(key);
+            auto [i, inserted] = prepare(key, hash);
+            if (inserted) {
+                new (&slots_[i]) entry{K(std::forward<KK>(key)), V(std::forward<VV>(value))};
+                ctrl_[i] = h2(hash);
+                ++size_;
+            } else {
+                slots_[i].value = std::forward<VV>(value);
+            }
+            return inserted;
+        }
+
+        // returns the value of key, putting a default-constructed one first if needed
+        V &operator[](const K &key) {
+            auto hash = hash_of(key);
+            auto [i, inserted] = prepare(key, hash);
+            if (inserted) {
+                new (&slots_[i]) entry{key, V{}};
+                ctrl_[i] = h2(hash);
+                ++size_;
+            }
+            return slots_[i].value;
+        }
+
+        // removes key, and returns whether it was there
+        bool erase(const K &key) {
+            auto i = find_index(key, hash_of(key));
+            if (i == cap_) return false;
+            slots_[i].~entry();
+            --size_;
+            // a slot can become empty again only if no probe ever went past its group
+            if (group::match_empty(ctrl_ + i / group::width * group::width) != 0) {
+                ctrl_[i] = group::empty;
+                ++growth_left_;
+            } else {
+                ctrl_[i] = group::deleted;
+            }
+            if (cap_ > min_capacity && size_ < cap_ / 4) rehash(cap_ / 2);
+            return true;
+        }
+
+        // removes every pair, keeping the slots
+        void clear() {
+            if (cap_ == 0) return;
+            for (std::size_t i = 0; i < cap_; ++i) {
+                if (group::is_full(ctrl_[i])) slots_[i].~entry();
+            }
+            std::memset(ctrl_, group::empty, cap_);
+            size_ = 0;
+            growth_left_ = max_load(cap_);
+        }
+
+    private:
+        using group = detail::ctrl_group;
+        static constexpr std::size_t min_capacity = 16;
+
+        Hash hash_;
+        Eq eq_;
+        entry *slots_ {};
+        std::uint8_t *ctrl_ {};      // control bytes, allocated behind the slots
+        std::size_t cap_ {};         // power of two
+        std::size_t size_ {};
+        std::size_t growth_left_ {}; // empty slots that can be taken before growing
+
+        static constexpr std::size_t max_load(std::size_t cap) { return cap - cap / 8; }
+        static std::uint8_t h2(std::size_t hash) { return static_cast<std::uint8_t>(hash & 0x7F); }
+
+        // spreads the bits of the hash, since std::hash is the identity for integers
+        std::size_t hash_of(const K &key) const {
+            std::uint64_t h = static_cast<std::uint64_t>(hash_(key));
+            h ^= h >> 33;
+            h *= 0xFF51AFD7ED558CCDULL;
+            h ^= h >> 33;
+            h *= 0xC4CEB9FE1A85EC53ULL;
+            h ^= h >> 33;
+            return static_cast<std::size_t>(h);
+        }
+
+        std::size_t find_index(const K &key, std::size_t hash) const {
+            // a moved-from map has no slots until its next insertion
+            if (cap_ == 0) return cap_;
+            auto gmask = cap_ / group::width - 1;
+            auto g = (hash >> 7) & gmask;
+            for (std::size_t step = 1; ; ++step) {
+                auto ctrl = ctrl_ + g * group::width;
+                for (auto m = group::match(ctrl, h2(hash)); m != 0; m &= m - 1) {
+                    auto i = g * group::width + group::lane(m);
+                    if (eq_(slots_[i].key, key)) return i;
+                }
+                if (group::match_empty(ctrl) != 0) return cap_;
+                g = (g + step) & gmask;
+            }
+        }
+
+        std::size_t find_free(std::size_t hash) const {
+            auto gmask = cap_ / group::width - 1;
+            auto g = (hash >> 7) & gmask;
+            for (std::size_t step = 1; ; ++step) {
+                auto m = group::match_free(ctrl_ + g * group::width);
+                if (m != 0) return g * group::width + group::lane(m);
+                g = (g + step) & gmask;
+            }
+        }
+
+        // returns the slot of key, or a free slot for it and true. the caller constructs
+        // the pair in the free slot and then sets its control byte
+        std::pair<std::size_t, bool> prepare(const K &key, std::size_t hash) {
+            auto i = find_index(key, hash);
+            if (i != cap_) return {i, false};
+            if (growth_left_ == 0) {
+                // when deleted slots take most of the room, rehashing at the same size is enough
+                rehash(size_ < max_load(cap_) / 2 ? cap_ : cap_ * 2);
+            }
+            i = find_free(hash);
+            if (ctrl_[i] == group::empty) --growth_left_;
+            return {i, true};
+        }
+
+        void rehash(std::size_t newcap) {
+            if (newcap < min_capacity) newcap = min_capacity;
+            auto mem = std::malloc((sizeof(entry) + 1) * newcap);
+            if (mem == nullptr) throw std::bad_alloc{};
+            auto oldslots = slots_;
+            auto oldctrl = ctrl_;
+            auto oldcap = cap_;
+            slots_ = static_cast<entry *>(mem);
+            ctrl_ = reinterpret_cast<std::uint8_t *>(slots_ + newcap);
+            cap_ = newcap;
+            std::memset(ctrl_, group::empty, newcap);
+            for (std::size_t i = 0; i < oldcap; ++i) {
+                if (!group::is_full(oldctrl[i])) continue;
+                auto hash = hash_of(oldslots[i].key);
+                auto j = find_free(hash);
+                new (&slots_[j]) entry{std::move(oldslots[i])};
+                ctrl_[j] = h2(hash);
+                oldslots[i].~entry();
+            }
+            growth_left_ = max_load(newcap) - size_;
+            std::free(oldslots);
+        }
+
+        void destroy() {
+            if (slots_ == nullptr) return;
+            for (std::size_t i = 0; i < cap_; ++i) {
+                if (group::is_full(ctrl_[i])) slots_[i].~entry();
+            }
+            std::free(slots_);
+            slots_ = nullptr;
+        }
+    };
+}
@@ -1,7 +1,444 @@
+// build with -pthread, together with map.c and cmap.c
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cmap.h"
 #include "map.h"
 
+// stops the tests at the first failed check
+#define CHECK(COND) do { \
+        if (!(COND)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #COND); \
+            exit(1); \
+        } \
+    } while (0)
+
+// keys of the checks are integers stored in the pointers
+static size_t int_hashcode(Map *map, void *key) {
+    (void)map;
+    size_t h = (size_t)key;
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return h;
+}
+
+static bool int_equal(void *key1, void *key2) {
+    return key1 == key2;
+}
+
+// puts, removes and looks up random keys against a plain array. the key range
+// changes every round, so that the map keeps growing, shrinking and moving pairs
+// between old and new slots while it is used and iterated
+static void check_against_array(void) {
+    enum { KEYS = 4096 };
+    static size_t ref[KEYS + 1]; // value of each key, 0 if absent
+    Map *m = createHashMap(int_hashcode, int_equal);
+    CHECK(m != NULL);
+    size_t size = 0;
+    for (int round = 0; round < 40; ++round) {
+        size_t range = 16 + (size_t)(rand() % KEYS);
+        // dropping the keys past the range shrinks the map
+        for (size_t k = range + 1; k <= KEYS; ++k) {
+            if (ref[k] != 0 && rand() % 8 != 0) {
+                m->remove(m, (void *)k);
+                --size;
+                ref[k] = 0;
+            }
+        }
+        for (int i = 0; i < 20000; ++i) {
+            size_t k = 1 + (size_t)rand() % range, v = (size_t)rand() + 1;
+            switch (rand() % 4) {
+            case 0:
+                CHECK(m->put(m, (void *)k, (void *)v) == 0);
+                size += ref[k] == 0;
+                ref[k] = v;
+                break;
+            case 1:
+                m->remove(m, (void *)k);
+                size -= ref[k] != 0;
+                ref[k] = 0;
+                break;
+            case 2:
+                CHECK((size_t)m->get(m, (void *)k) == ref[k]);
+                break;
+            default:
+                CHECK(m->exists(m, (void *)k) == (ref[k] != 0));
+            }
+            CHECK(m->size == size);
+        }
+        // every pair once, and nothing else
+        size_t seen = 0;
+        MapIterator it;
+        initHashMapIterator(&it, m);
+        while (it.has_next(&it)) {
+            it.next(&it);
+            CHECK(ref[(size_t)it.curr->key] == (size_t)it.curr->value);
+            ++seen;
+        }
+        it.free(&it);
+        CHECK(seen == size);
+        void *keys[64], *values[64];
+        for (size_t k = 0; k < 64; ++k)
+            keys[k] = (void *)(1 + (size_t)rand() % KEYS);
+        map_get_batch(m, keys, values, 64);
+        for (size_t k = 0; k < 64; ++k)
+            CHECK((size_t)values[k] == ref[(size_t)keys[k]]);
+    }
+    m->free(m);
+}
+
+// shrinks the map and puts right away, while the old pairs are still being moved,
+// with the least room min_load leaves for them
+static void check_shrink_then_put(void) {
+    Map *m = createHashMap(int_hashcode, int_equal);
+    CHECK(m != NULL);
+    CHECK(map_set_load_factors(m, 0.875f, 0.43f) == 1);
+    CHECK(map_set_load_factors(m, 0.875f, 0.40625f) == 0);
+    size_t next = 1, first = 1;
+    for (int round = 0; round < 20; ++round) {
+        size_t target = 1000 + (size_t)(rand() % 20000);
+        while (m->size < target) {
+            CHECK(m->put(m, (void *)next, (void *)next) == 0);
+            ++next;
+        }
+        size_t listsize = m->list_size;
+        while (m->list_size == listsize && first < next) {
+            m->remove(m, (void *)first);
+            ++first;
+        }
+        // an open iterator keeps the old pairs from moving
+        MapIterator it;
+        if (round % 2)
+            initHashMapIterator(&it, m);
+        for (int i = 0; i < 5000; ++i) {
+            CHECK(m->put(m, (void *)next, (void *)next) == 0);
+            ++next;
+            CHECK(m->growth_left <= m->list_size);
+        }
+        if (round % 2)
+            it.free(&it);
+    }
+    CHECK(m->size == next - first);
+    for (size_t k = 1; k < next; ++k)
+        CHECK(m->exists(m, (void *)k) == (k >= first));
+    m->free(m);
+}
+
+// runs of 300 consecutive keys share H1, so their probes spill over many groups and
+// across the parts of map_build_parallel(). the map mixes custom hashcodes, so this
+// returns what that mix turns into the wanted hash
+static size_t cluster_hashcode(Map *map, void *key) {
+    size_t k = (size_t)key;
+    uint64_t h = (uint64_t)int_hashcode(map, (void *)(k / 300)) << 7 | (k % 300 & 0x7F);
+    // inverse of the mix of map_hash(); a shift of 33 undoes itself
+    h ^= h >> 33;
+    h *= 0x9CB4B2F8129337DBULL;
+    h ^= h >> 33;
+    h *= 0x4F74430C22A54005ULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+// builds the same pairs on different numbers of threads, and checks them against a
+// plain array, then checks that range iterators visit each pair exactly once
+static void check_build_parallel(void) {
+    enum { N = 30000 };
+    static void *keys[N], *values[N];
+    static unsigned char seen[N + 1];
+    for (size_t i = 0; i < N; ++i) {
+        keys[i] = (void *)(i + 1);
+        values[i] = (void *)((i + 1) * 5);
+    }
+    int threads[] = { 1, 2, 4, 8 };
+    for (size_t t = 0; t < sizeof threads / sizeof *threads; ++t) {
+        Map *m = createHashMap(cluster_hashcode, int_equal);
+        CHECK(m != NULL);
+        CHECK(map_build_parallel(m, keys, values, N, threads[t]) == 0);
+        CHECK(m->size == N);
+        for (size_t i = 0; i < N; ++i)
+            CHECK(m->get(m, keys[i]) == values[i]);
+        CHECK(!m->exists(m, (void *)(N + 1)) && !m->exists(m, NULL));
+
+        size_t nparts[] = { 1, 3, 8 };
+        for (size_t p = 0; p < sizeof nparts / sizeof *nparts; ++p) {
+            memset(seen, 0, sizeof seen);
+            size_t total = 0;
+            for (size_t part = 0; part < nparts[p]; ++part) {
+                MapIterator it;
+                initHashMapRangeIterator(&it, m, part, nparts[p]);
+                while (it.has_next(&it)) {
+                    it.next(&it);
+                    size_t k = (size_t)it.curr->key;
+                    CHECK(k >= 1 && k <= N && it.curr->value == (void *)(k * 5));
+                    CHECK(seen[k]++ == 0);
+                    ++total;
+                }
+                it.free(&it);
+            }
+            CHECK(total == N);
+        }
+        m->free(m);
+    }
+}
+
+// puts batches with keys repeated inside them into one map, and the same pairs one by
+// one into another. the key range grows, so maps resize in the middle of batches
+static void check_put_batch(void) {
+    enum { MAXBATCH = 300 };
+    static void *keys[MAXBATCH], *values[MAXBATCH];
+    Map *batched = createHashMap(int_hashcode, int_equal), *single = createHashMap(int_hashcode, int_equal);
+    CHECK(batched != NULL && single != NULL);
+    int resized = 0;
+    size_t range = 8;
+    for (int round = 0; round < 400; ++round) {
+        size_t n = 1 + (size_t)rand() % MAXBATCH;
+        for (size_t i = 0; i < n; ++i) {
+            // a key repeats at least once in most batches; the last value wins
+            keys[i] = (void *)(1 + (size_t)rand() % range);
+            values[i] = (void *)(size_t)(round * MAXBATCH + i + 1);
+            if (i > 0 && rand() % 8 == 0)
+                keys[i] = keys[rand() % i];
+        }
+        size_t listsize = batched->list_size;
+        CHECK(map_put_batch(batched, keys, values, n) == 0);
+        resized += batched->list_size != listsize;
+        for (size_t i = 0; i < n; ++i)
+            CHECK(single->put(single, keys[i], values[i]) == 0);
+        CHECK(batched->size == single->size);
+        for (size_t i = 0; i < n; ++i)
+            CHECK(batched->get(batched, keys[i]) == single->get(single, keys[i]));
+        range += (size_t)rand() % 200;
+    }
+    CHECK(resized > 5);
+    for (size_t k = 1; k <= range; ++k)
+        CHECK(batched->get(batched, (void *)k) == single->get(single, (void *)k));
+    batched->free(batched);
+    single->free(single);
+}
+
+// checks the sizing calls: reserve, a pinned capacity, load factors and shrink_to_fit
+static void check_sizing(void) {
+    // reserved room is enough for the puts that follow
+    Map *m = createHashMap(int_hashcode, int_equal);
+    CHECK(m != NULL && map_reserve(m, 10000) == 0);
+    size_t listsize = m->list_size;
+    CHECK(m->oldlist == NULL && m->growth_left >= 10000);
+    for (size_t k = 1; k <= 10000; ++k) {
+        CHECK(m->put(m, (void *)k, (void *)k) == 0);
+        CHECK(m->list_size == listsize && m->oldlist == NULL);
+    }
+    // reserving what is already there does nothing
+    CHECK(map_reserve(m, 10000) == 0 && m->list_size == listsize);
+
+    // shrink_to_fit after most keys are gone keeps the rest reachable
+    CHECK(map_set_load_factors(m, 0.875f, 0) == 0);
+    for (size_t k = 1; k <= 10000; ++k)
+        if (k % 50 != 0)
+            m->remove(m, (void *)k);
+    CHECK(m->size == 200 && m->list_size == listsize);
+    CHECK(map_shrink_to_fit(m) == 0);
+    CHECK(m->list_size < listsize && m->oldlist == NULL && m->list_size >= 200);
+    for (size_t k = 1; k <= 10000; ++k)
+        CHECK(m->get(m, (void *)k) == (k % 50 == 0 ? (void *)k : NULL));
+    listsize = m->list_size;
+    CHECK(map_shrink_to_fit(m) == 0 && m->list_size == listsize);
+    m->free(m);
+
+    // a pinned map fails puts once it is full, and churn reuses its slots in place
+    m = createHashMap(int_hashcode, int_equal);
+    CHECK(m != NULL && map_reserve(m, 1000) == 0);
+    m->auto_assign = false;
+    listsize = m->list_size;
+    size_t n = 0;
+    while (m->put(m, (void *)(n + 1), (void *)(n + 1)) == 0)
+        ++n;
+    CHECK(n >= 1000 && n < listsize && m->size == n && m->list_size == listsize);
+    for (size_t k = 1; k <= n; ++k)
+        CHECK(m->get(m, (void *)k) == (void *)k);
+    size_t first = 1, next = n + 1;
+    for (int i = 0; i < 100000; ++i) {
+        if (rand() % 2 && first < next) {
+            m->remove(m, (void *)first);
+            ++first;
+        } else if (next - first < n / 2) {
+            CHECK(m->put(m, (void *)next, (void *)next) == 0);
+            ++next;
+        }
+        CHECK(m->list_size == listsize);
+    }
+    CHECK(m->size == next - first);
+    for (size_t k = first; k < next; ++k)
+        CHECK(m->get(m, (void *)k) == (void *)k);
+    m->free(m);
+
+    // invalid load factors are refused and change nothing
+    m = createHashMap(int_hashcode, int_equal);
+    CHECK(m != NULL);
+    float max = m->max_load, min = m->min_load;
+    CHECK(map_set_load_factors(m, 0.05f, 0) == 1);
+    CHECK(map_set_load_factors(m, 0.95f, 0.1f) == 1);
+    CHECK(map_set_load_factors(m, 0.5f, 0.25f) == 1);
+    CHECK(map_set_load_factors(m, 0.5f, -0.1f) == 1);
+    CHECK(map_set_load_factors(m, 0.0f / 0.0f, 0.1f) == 1);
+    CHECK(m->max_load == max && m->min_load == min);
+    CHECK(map_set_load_factors(m, 0.5f, 0.21875f) == 0);
+    m->free(m);
+}
+
+// ConcurrentMap stress: two writers put and remove keys of their own parity while
+// two readers look them up. a value is always its key * 3 + 1, so readers can tell
+// a torn or stale one
+#define CKEYS 20000
+
+static size_t cmap_int_hashcode(ConcurrentMap *map, void *key) {
+    (void)map;
+    return int_hashcode(NULL, key);
+}
+
+typedef struct cwriter {
+    ConcurrentMap *map;
+    size_t parity;
+    unsigned seed;
+    char ref[CKEYS + 1];   // whether each key of this writer is in the map
+} cwriter;
+
+static atomic_int cwriters_left;
+
+static void *cmap_writer(void *arg) {
+    cwriter *w = (cwriter *)arg;
+    for (int i = 0; i < 200000; ++i) {
+        // the range keeps changing, so the table grows while readers are in it
+        size_t range = i % 50000 < 25000 ? CKEYS : CKEYS / 20;
+        size_t k = 1 + (size_t)rand_r(&w->seed) % range;
+        k += (k & 1) != w->parity;
+        if (k > CKEYS)
+            continue;
+        if (rand_r(&w->seed) % 3 != 0) {
+            CHECK(w->map->put(w->map, (void *)k, (void *)(k * 3 + 1)) == 0);
+            w->ref[k] = 1;
+        } else {
+            w->map->remove(w->map, (void *)k);
+            w->ref[k] = 0;
+        }
+    }
+    atomic_fetch_sub(&cwriters_left, 1);
+    return NULL;
+}
+
+static void *cmap_reader(void *arg) {
+    ConcurrentMap *map = (ConcurrentMap *)arg;
+    unsigned seed = 7;
+    while (atomic_load(&cwriters_left) > 0) {
+        size_t k = 1 + (size_t)rand_r(&seed) % CKEYS;
+        size_t v = (size_t)map->get(map, (void *)k);
+        CHECK(v == 0 || v == k * 3 + 1);
+        (void)map->exists(map, (void *)k);
+    }
+    return NULL;
+}
+
+static void check_concurrent_map(void) {
+    ConcurrentMap *map = createConcurrentHashMap(cmap_int_hashcode, int_equal);
+    CHECK(map != NULL);
+    static cwriter writers[2];
+    pthread_t threads[4];
+    atomic_store(&cwriters_left, 2);
+    for (int i = 0; i < 2; ++i) {
+        writers[i].map = map;
+        writers[i].parity = (size_t)i;
+        writers[i].seed = (unsigned)i + 1;
+        CHECK(pthread_create(&threads[i], NULL, cmap_writer, &writers[i]) == 0);
+        CHECK(pthread_create(&threads[2 + i], NULL, cmap_reader, map) == 0);
+    }
+    for (int i = 0; i < 4; ++i)
+        pthread_join(threads[i], NULL);
+    size_t size = 0;
+    for (size_t k = 1; k <= CKEYS; ++k) {
+        bool in = writers[k & 1].ref[k];
+        size += in;
+        CHECK((size_t)map->get(map, (void *)k) == (in ? k * 3 + 1 : 0));
+    }
+    CHECK(map->size(map) == size);
+    map->free(map);
+}
+
+// writes a snapshot of string pairs, reads it back, and then reads copies of it whose
+// key offsets point out of the file
+static void check_snapshot(void) {
+    enum { N = 2000 };
+    static char keys[N][16], values[N][16];
+    Map *m = createHashMap(NULL, NULL);
+    CHECK(m != NULL);
+    for (int i = 0; i < N; ++i) {
+        snprintf(keys[i], sizeof keys[i], "key%d", i);
+        snprintf(values[i], sizeof values[i], "value%d", i * 7);
+        CHECK(m->put(m, keys[i], values[i]) == 0);
+    }
+    char path[] = "/tmp/mapsnapXXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd != -1);
+    close(fd);
+    CHECK(map_snapshot_write(m, path, NULL) == 0);
+    m->free(m);
+
+    Map *s = openHashMapSnapshot(path);
+    CHECK(s != NULL && s->size == N);
+    for (int i = 0; i < N; ++i) {
+        const char *v = s->get(s, keys[i]);
+        CHECK(v != NULL && strcmp(v, values[i]) == 0 && s->exists(s, keys[i]));
+    }
+    CHECK(s->get(s, (void *)"key") == NULL && !s->exists(s, (void *)"key2000"));
+    CHECK(s->put(s, (void *)"new", (void *)"pair") != 0 && !s->exists(s, (void *)"new"));
+    s->remove(s, keys[0]);
+    CHECK(s->exists(s, keys[0]) && s->size == N);
+    s->free(s);
+
+    // the header is 6 words: magic, file_size, npairs, nslots, ctrl_off, slots_off,
+    // and every slot is hash, key_off, value_off
+    FILE *f = fopen(path, "rb");
+    CHECK(f != NULL);
+    uint64_t h[6];
+    CHECK(fread(h, sizeof h, 1, f) == 1);
+    char *file = malloc(h[1]);
+    CHECK(file != NULL);
+    rewind(f);
+    CHECK(fread(file, 1, h[1], f) == h[1]);
+    fclose(f);
+    uint64_t *slots = (uint64_t *)(file + h[5]), bad[] = { h[1], h[1] - 1, UINT64_MAX - 2 };
+    size_t used = 0;
+    while (slots[used * 3 + 1] == 0)
+        ++used;
+    for (size_t b = 0; b < sizeof bad / sizeof *bad; ++b) {
+        uint64_t good = slots[used * 3 + 1];
+        slots[used * 3 + 1] = bad[b];
+        CHECK((f = fopen(path, "wb")) != NULL && fwrite(file, 1, h[1], f) == h[1]);
+        fclose(f);
+        slots[used * 3 + 1] = good;
+        CHECK((s = openHashMapSnapshot(path)) != NULL);
+        int missing = 0;
+        for (int i = 0; i < N; ++i) {
+            const char *v = s->get(s, keys[i]);
+            CHECK(v == NULL || strcmp(v, values[i]) == 0);
+            missing += v == NULL;
+        }
+        CHECK(missing == 1);
+        s->free(s);
+    }
+
+    // a header that does not describe the file is refused
+    ((uint64_t *)file)[5] = h[1];
+    CHECK((f = fopen(path, "wb")) != NULL && fwrite(file, 1, h[1], f) == h[1]);
+    fclose(f);
+    CHECK(openHashMapSnapshot(path) == NULL);
+    free(file);
+    unlink(path);
+}
+
 typedef struct spam {
     const char *msg;
 } spam;
@@ -14,6 +451,14 @@ static spam *cspam(const char *msg) {
 }
 
 int main(void) {
+    check_against_array();
+    check_shrink_then_put();
+    check_concurrent_map();
+    check_snapshot();
+    check_build_parallel();
+    check_sizing();
+    check_put_batch();
+
     Map *m = createHashMap(NULL, NULL);
     m->put(m, (void *)"dafwtggd",   (void *)cspam("ssfabb"));
     m->put(m, (void *)"bfdr",       (void *)cspam("ssfabb"));
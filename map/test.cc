@@ -0,0 +1,120 @@
+// checks of oneesama::hash_map against std::unordered_map
+// build: c++ -std=c++17 -O2 test.cc -o test_cc
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <utility>
+
+#include "map.hh"
+
+// stops the tests at the first failed check
+#define CHECK(COND) do { \
+        if (!(COND)) { \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #COND); \
+            std::exit(1); \
+        } \
+    } while (0)
+
+namespace {
+
+    // the pairs of m and ref are the same, and iterating m visits each once
+    template<class K, class V>
+    void check_same(const oneesama::hash_map<K, V> &m, const std::unordered_map<K, V> &ref) {
+        CHECK(m.size() == ref.size() && m.empty() == ref.empty());
+        std::size_t n = 0;
+        for (auto &e : m) {
+            auto it = ref.find(e.key);
+            CHECK(it != ref.end() && it->second == e.value);
+            ++n;
+        }
+        CHECK(n == ref.size());
+        for (auto &[k, v] : ref) {
+            auto found = m.find(k);
+            CHECK(found != nullptr && *found == v);
+        }
+    }
+
+    // random insert_or_assign, erase and operator[] on a key range that grows and
+    // shrinks, so that erases shrink the map and it is iterated right after
+    void check_random() {
+        std::mt19937 rng{42};
+        oneesama::hash_map<int, unsigned> m;
+        std::unordered_map<int, unsigned> ref;
+        int shrinks = 0;
+        for (int round = 0; round < 60; ++round) {
+            int range = 1 + static_cast<int>(rng() % (round % 2 ? 20000 : 200));
+            for (int i = 0; i < 20000; ++i) {
+                int k = static_cast<int>(rng() % static_cast<unsigned>(range));
+                unsigned v = static_cast<unsigned>(rng());
+                switch (rng() % 4) {
+                case 0:
+                    CHECK(m.insert_or_assign(k, v) == ref.insert_or_assign(k, v).second);
+                    break;
+                case 1: {
+                    auto cap = m.capacity();
+                    CHECK(m.erase(k) == (ref.erase(k) == 1));
+                    shrinks += m.capacity() < cap;
+                    if (m.capacity() < cap) check_same(m, ref);
+                    break;
+                }
+                case 2:
+                    m[k] += v;
+                    ref[k] += v;
+                    break;
+                default:
+                    CHECK(m.contains(k) == (ref.count(k) == 1));
+                }
+            }
+            check_same(m, ref);
+            // drop most of the keys, as the next range may be small
+            for (int k = 0; k < range; k += 1 + k % 3) {
+                auto cap = m.capacity();
+                CHECK(m.erase(k) == (ref.erase(k) == 1));
+                shrinks += m.capacity() < cap;
+            }
+            check_same(m, ref);
+        }
+        CHECK(shrinks > 0);
+        m.clear();
+        ref.clear();
+        check_same(m, ref);
+    }
+
+    // keys and values that own memory, through moves of the whole map
+    void check_moves() {
+        oneesama::hash_map<std::string, std::string> a;
+        std::unordered_map<std::string, std::string> ref;
+        for (int i = 0; i < 1000; ++i) {
+            auto k = "key" + std::to_string(i);
+            a.insert_or_assign(k, std::string(static_cast<std::size_t>(i % 50), 'v'));
+            ref[k] = std::string(static_cast<std::size_t>(i % 50), 'v');
+        }
+        auto b = std::move(a);
+        check_same(b, ref);
+
+        // the moved-from map is empty and usable again
+        std::unordered_map<std::string, std::string> empty;
+        check_same(a, empty);
+        CHECK(a.find("key1") == nullptr && !a.erase("key1"));
+        for (int i = 0; i < 100; ++i) a["again" + std::to_string(i)] = "x";
+        CHECK(a.size() == 100 && a.contains("again99") && *a.find("again0") == "x");
+        for (int i = 0; i < 100; ++i) CHECK(a.erase("again" + std::to_string(i)));
+        check_same(a, empty);
+
+        // assigning over a map frees its pairs and takes the others
+        a.insert_or_assign(std::string("lost"), std::string("pair"));
+        a = std::move(b);
+        check_same(a, ref);
+        check_same(b, empty);
+        b.insert_or_assign(std::string("k"), std::string("v"));
+        CHECK(b.size() == 1 && *b.find("k") == "v");
+    }
+}
+
+int main() {
+    check_random();
+    check_moves();
+    std::printf("checks passed\n");
+}
@@ -5,14 +5,27 @@
 #define NEW(TYPE) (TYPE *)malloc(sizeof(TYPE))
 #define DELETE(VAR) free((VAR))
 
-// returns NULL if allocation fails
-static DequeNode *get_node(void *value) {
-    DequeNode *node = NEW(DequeNode);
-    if (node == NULL)
-        return NULL;
-    node->value = value;
-    node->left = node->right = NULL;
-    return node;
+#define MIN_CAP 16
+
+// slot of the value at index i
+#define SLOT(DEQUE, I) (((DEQUE)->head + (I)) & ((DEQUE)->cap - 1))
+
+// doubles the capacity when the deque is full, moving the values to the start of
+// the new buffer; returns nonzero if allocation fails
+static int reserve_one(Deque *deque) {
+    if (deque->size < deque->cap)
+        return 0;
+    size_t newcap = deque->cap ? deque->cap * 2 : MIN_CAP;
+    void **values = (void **)malloc(sizeof(void *) * newcap);
+    if (values == NULL)
+        return 1;
+    for (size_t i = 0; i < deque->size; ++i)
+        values[i] = deque->values[SLOT(deque, i)];
+    DELETE(deque->values);
+    deque->values = values;
+    deque->cap = newcap;
+    deque->head = 0;
+    return 0;
 }
 
 Deque *deque_create() {
@@ -20,23 +33,20 @@ Deque *deque_create() {
     if (deque == NULL)
         return NULL;
     deque->size = 0;
-    deque->leftmost = deque->rightmost = NULL;
+    deque->cap = 0;
+    deque->head = 0;
+    deque->values = NULL;
     return deque;
 }
 
 void deque_clear(Deque *deque) {
-    DequeNode *curr = deque->leftmost;
-    while (curr != NULL) {
-        DequeNode *tmp = curr;
-        curr = curr->right;
-        DELETE(tmp);
-    }
     deque->size = 0;
-    deque->leftmost = deque->rightmost = NULL;
+    deque->head = 0;
 }
 
 void deque_free(Deque *deque) {
     deque_clear(deque);
+    DELETE(deque->values);
     DELETE(deque);
 }
 
@@ -45,34 +55,21 @@ bool deque_isempty(Deque *deque) {
 }
 
 int deque_push_left(Deque *deque, void *value) {
-    DequeNode *newnode = get_node(value);
-    if (newnode == NULL)
+    if (reserve_one(deque) != 0)
         return 1;
 
-    if (deque_isempty(deque)) {
-        deque->leftmost = deque->rightmost = newnode;
-    } else {
-        newnode->right = deque->leftmost;
-        deque->leftmost->left = newnode;
-        deque->leftmost = newnode;
-    }
+    deque->head = (deque->head - 1) & (deque->cap - 1);
+    deque->values[deque->head] = value;
     ++deque->size;
 
     return 0;
 }
 
 int deque_push_right(Deque *deque, void *value) {
-    DequeNode *newnode = get_node(value);
-    if (newnode == NULL)
+    if (reserve_one(deque) != 0)
         return 1;
 
-    if (deque_isempty(deque)) {
-        deque->rightmost = deque->leftmost = newnode;
-    } else {
-        newnode->left = deque->rightmost;
-        deque->rightmost->right = newnode;
-        deque->rightmost = newnode;
-    }
+    deque->values[SLOT(deque, deque->size)] = value;
     ++deque->size;
 
     return 0;
@@ -82,16 +79,8 @@ void *deque_pop_left(Deque *deque) {
     if (deque_isempty(deque))
         return NULL;
 
-    DequeNode *curr = deque->leftmost;
-    void *value = curr->value;
-    deque->leftmost = curr->right;
-
-    if (deque->leftmost == NULL) // curr was the only node
-        deque->rightmost = NULL;
-    else
-        deque->leftmost->left = NULL;
-
-    DELETE(curr);
+    void *value = deque->values[deque->head];
+    deque->head = (deque->head + 1) & (deque->cap - 1);
     --deque->size;
 
     return value;
@@ -101,25 +90,19 @@ void *deque_pop_right(Deque *deque) {
     if (deque_isempty(deque))
         return NULL;
 
-    DequeNode *curr = deque->rightmost;
-    void *value = curr->value;
-    deque->rightmost = curr->left;
-
-    if (deque->rightmost == NULL) // curr was the only node
-        deque->leftmost = NULL;
-    else
-        deque->rightmost->right = NULL;
-
-    DELETE(curr);
     --deque->size;
 
-    return value;
+    return deque->values[SLOT(deque, deque->size)];
 }
 
 void *deque_left(Deque *deque) {
-    return deque_isempty(deque) ? NULL : deque->leftmost->value;
+    return deque_isempty(deque) ? NULL : deque->values[deque->head];
 }
 
 void *deque_right(Deque *deque) {
-    return deque_isempty(deque) ? NULL : deque->rightmost->value;
+    return deque_isempty(deque) ? NULL : deque->values[SLOT(deque, deque->size - 1)];
+}
+
+void *deque_at(Deque *deque, size_t i) {
+    return i < deque->size ? deque->values[SLOT(deque, i)] : NULL;
 }
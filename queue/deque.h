@@ -8,31 +8,27 @@
 extern "C" {
 #endif
 
-// the node in the linked list
-// behaviour is undefined if these fields are written
-typedef struct DequeNode {
-    void *value;
-    struct DequeNode *left;
-    struct DequeNode *right;
-} DequeNode;
-
 // the deque object to operate on
+// values are kept in a ring buffer whose capacity is a power of two; it doubles
+// when full and is kept when values are popped, so that pushes and pops allocate
+// nothing once it is large enough
 // behaviour is undefined if these fields are written
 typedef struct Deque {
-    size_t size; // number of values stored in the deque
-    DequeNode *leftmost;
-    DequeNode *rightmost;
+    size_t size;   // number of values stored in the deque
+    size_t cap;    // capacity of values, 0 or a power of two
+    size_t head;   // index of the leftmost value
+    void **values;
 } Deque;
 
 // creates a new deque with size 0; NULL is returned if this fails
 Deque *deque_create();
 
-// clears all the value nodes from the deque (llist) and resets size to be 0
-// NOT the void* values stored in each node if they are heap objects
+// clears all the values from the deque and resets size to be 0, keeping the buffer
+// NOT the void* values stored if they are heap objects
 // (then why is this function useful? prolly in cases you store words in this struct)
 void deque_clear(Deque *deque);
 
-// deallocate the deque itself and its nodes; this function also calls deque_clear()
+// deallocate the deque itself and its buffer; this function also calls deque_clear()
 void deque_free(Deque *deque);
 
 // returns whether deque is empty
@@ -46,22 +42,26 @@ int deque_push_left(Deque *deque, void *value);
 // if this fails
 int deque_push_right(Deque *deque, void *value);
 
-// removes the leftmost value node and returns its contained value
+// removes the leftmost value and returns it
 // NULL is returned if deque is empty
 void *deque_pop_left(Deque *deque);
 
-// removes the rightmost value node and returns its contained value
+// removes the rightmost value and returns it
 // NULL is returned if deque is empty
 void *deque_pop_right(Deque *deque);
 
-// returns the contained value of the leftmost node
+// returns the leftmost value
 // NULL is returned if deque is empty
 void *deque_left(Deque *deque);
 
-// returns the contained value of the rightmost node
+// returns the rightmost value
 // NULL is returned if deque is empty
 void *deque_right(Deque *deque);
 
+// returns the value at index i, counting from 0 at the leftmost one
+// NULL is returned if i is not less than the size
+void *deque_at(Deque *deque, size_t i);
+
 #ifdef __cplusplus
 }
 #endif
@@ -1,3 +1,6 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 #include "deque.h"
@@ -14,6 +17,11 @@
     #define SHOULD_UNLOCK(PLOCK)
 #endif
 
+#define CACHE_LINE 64
+
+// jobs taken off the queue at once
+#define RUN_BATCH 32
+
 // entry of the deque
 typedef struct QueuedJob {
     EventCallback func;
@@ -23,22 +31,157 @@ typedef struct QueuedJob {
 // closely related to eventqueue_send_stop()
 static QueuedJob queued_stop_sig;
 
-// the deque: push job to left, get job from right
+// the ring of the lock-free backends. jobs are stored in the slots by value, and a
+// stop signal is a job without func. the consumer and producer indices each sit on
+// a cache line of their own. the slots follow the struct: QueuedJob for EVQ_SPSC,
+// and RingCell for EVQ_MPMC
+struct EvqRing {
+    _Alignas(CACHE_LINE) atomic_size_t head; // next job to run, written by consumers
+    _Alignas(CACHE_LINE) atomic_size_t tail; // next slot to fill, written by producers
+    size_t head_cache;                       // EVQ_SPSC: head as last seen by the producer
+    _Alignas(CACHE_LINE) size_t mask;        // slots - 1
+    atomic_flag state_lock;                  // EVQ_MPMC: guards runners and evqueue->state
+    int runners;                             // EVQ_MPMC: threads running the queue
+};
 
-EventQueue *eventqueue_create() {
-    EventQueue *evqueue = NEW(EventQueue);
-    if (evqueue == NULL)
+// a slot of EVQ_MPMC. seq is its index while it is free for the producer of that
+// index, index + 1 once the job is stored, and index + slots once it is taken,
+// which frees it for the next round
+typedef struct RingCell {
+    atomic_size_t seq;
+    QueuedJob job;
+} RingCell;
+
+#define RING_JOBS(RING) ((QueuedJob *)((RING) + 1))
+#define RING_CELLS(RING) ((RingCell *)((RING) + 1))
+
+static struct EvqRing *ring_create(EventQueueBackend backend, size_t capacity) {
+    size_t slotsize = backend == EVQ_MPMC ? sizeof(RingCell) : sizeof(QueuedJob);
+    // the slots, rounded up to a power of two, and the padding must fit in a size_t
+    size_t maxslots = (SIZE_MAX - sizeof(struct EvqRing) - CACHE_LINE) / slotsize;
+    if (capacity > maxslots)
         return NULL;
-    Deque *callbackqueue = deque_create();
-    if (callbackqueue == NULL) {
-        DELETE(evqueue);
+    size_t slots = 2;
+    while (slots < capacity)
+        slots *= 2;
+    if (slots > maxslots)
+        return NULL;
+    size_t size = sizeof(struct EvqRing) + slotsize * slots;
+    struct EvqRing *ring = (struct EvqRing *)aligned_alloc(CACHE_LINE, (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    if (ring == NULL)
         return NULL;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    ring->head_cache = 0;
+    ring->mask = slots - 1;
+    atomic_flag_clear(&ring->state_lock);
+    ring->runners = 0;
+    if (backend == EVQ_MPMC) {
+        for (size_t i = 0; i < slots; ++i)
+            atomic_init(&RING_CELLS(ring)[i].seq, i);
     }
-    evqueue->callbackqueue = callbackqueue;
+    return ring;
+}
+
+// the producer keeps a copy of head, refreshed only when the ring looks full, so
+// that it rarely reads the line the consumer writes
+static int spsc_push(struct EvqRing *ring, EventCallback func, void *arg) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - ring->head_cache > ring->mask) {
+        ring->head_cache = atomic_load_explicit(&ring->head, memory_order_acquire);
+        if (tail - ring->head_cache > ring->mask)
+            return 1;
+    }
+    RING_JOBS(ring)[tail & ring->mask].func = func;
+    RING_JOBS(ring)[tail & ring->mask].arg = arg;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+// copies up to max jobs out of the ring and frees their slots with one store
+static size_t spsc_pop(struct EvqRing *ring, QueuedJob *jobs, size_t max) {
+    // acquire: the previous consumer may have been another thread
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t n = atomic_load_explicit(&ring->tail, memory_order_acquire) - head;
+    if (n > max)
+        n = max;
+    for (size_t i = 0; i < n; ++i) {
+        jobs[i] = RING_JOBS(ring)[(head + i) & ring->mask];
+        // the jobs after a stop signal stay for the next run
+        if (jobs[i].func == NULL)
+            n = i + 1;
+    }
+    atomic_store_explicit(&ring->head, head + n, memory_order_release);
+    return n;
+}
+
+// claims the slot of tail by moving it on, once the slot is free in this round
+static int mpmc_push(struct EvqRing *ring, EventCallback func, void *arg) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    RingCell *cell;
+    for (;;) {
+        cell = &RING_CELLS(ring)[tail & ring->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        if (seq == tail) {
+            if (atomic_compare_exchange_weak_explicit(&ring->tail, &tail, tail + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if ((ptrdiff_t)(seq - tail) < 0) {
+            // still holds the job of the previous round: full
+            return 1;
+        } else {
+            tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        }
+    }
+    cell->job.func = func;
+    cell->job.arg = arg;
+    atomic_store_explicit(&cell->seq, tail + 1, memory_order_release);
+    return 0;
+}
+
+// claims the filled slots from head on, up to max of them, by moving head past all
+// of them at once. filled slots stay filled until taken, so the check holds
+static size_t mpmc_pop(struct EvqRing *ring, QueuedJob *jobs, size_t max) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t n;
+    for (;;) {
+        n = 0;
+        size_t seq = 0;
+        while (n < max) {
+            seq = atomic_load_explicit(&RING_CELLS(ring)[(head + n) & ring->mask].seq, memory_order_acquire);
+            if (seq != head + n + 1)
+                break;
+            ++n;
+        }
+        if (n == 0) {
+            // not filled in this round yet: empty
+            if ((ptrdiff_t)(seq - (head + 1)) < 0)
+                return 0;
+            head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(&ring->head, &head, head + n,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            break;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        RingCell *cell = &RING_CELLS(ring)[(head + i) & ring->mask];
+        jobs[i] = cell->job;
+        atomic_store_explicit(&cell->seq, head + i + ring->mask + 1, memory_order_release);
+    }
+    return n;
+}
+
+static EventQueue *evqueue_alloc(EventQueueBackend backend) {
+    EventQueue *evqueue = NEW(EventQueue);
+    if (evqueue == NULL)
+        return NULL;
     evqueue->state = EVQ_STOPPED;
+    evqueue->backend = backend;
+    evqueue->callbackqueue = NULL;
+    evqueue->ring = NULL;
 #ifdef EVQ_USE_THREADSAFE
     if (pthread_mutex_init(&evqueue->callbackqueue_mtx, NULL) != 0) {
-        deque_free(evqueue->callbackqueue);
         DELETE(evqueue);
         return NULL;
     }
@@ -46,13 +189,50 @@ EventQueue *eventqueue_create() {
     return evqueue;
 }
 
+EventQueue *eventqueue_create() {
+    EventQueue *evqueue = evqueue_alloc(EVQ_DEQUE);
+    if (evqueue == NULL)
+        return NULL;
+    Deque *callbackqueue = deque_create();
+    if (callbackqueue == NULL) {
+        eventqueue_close(evqueue);
+        return NULL;
+    }
+    evqueue->callbackqueue = callbackqueue;
+    return evqueue;
+}
+
+static EventQueue *evqueue_create_ring(EventQueueBackend backend, size_t capacity) {
+    EventQueue *evqueue = evqueue_alloc(backend);
+    if (evqueue == NULL)
+        return NULL;
+    if ((evqueue->ring = ring_create(backend, capacity)) == NULL) {
+        eventqueue_close(evqueue);
+        return NULL;
+    }
+    return evqueue;
+}
+
+EventQueue *eventqueue_create_spsc(size_t capacity) {
+    return evqueue_create_ring(EVQ_SPSC, capacity);
+}
+
+EventQueue *eventqueue_create_mpmc(size_t capacity) {
+    return evqueue_create_ring(EVQ_MPMC, capacity);
+}
+
 void eventqueue_close(EventQueue *evqueue) {
     // get rid of all the remaining jobs if there is any
-    while (!deque_isempty(evqueue->callbackqueue)) {
-        QueuedJob *curr = (QueuedJob *)deque_pop_right(evqueue->callbackqueue);
-        DELETE(curr);
+    if (evqueue->callbackqueue != NULL) {
+        while (!deque_isempty(evqueue->callbackqueue)) {
+            QueuedJob *curr = (QueuedJob *)deque_pop_right(evqueue->callbackqueue);
+            if (curr != &queued_stop_sig)
+                DELETE(curr);
+        }
+        deque_free(evqueue->callbackqueue);
     }
-    deque_free(evqueue->callbackqueue);
+    // jobs of the ring are stored in it
+    DELETE(evqueue->ring);
 #ifdef EVQ_USE_THREADSAFE
     pthread_mutex_destroy(&evqueue->callbackqueue_mtx);
 #endif
@@ -60,50 +240,123 @@ void eventqueue_close(EventQueue *evqueue) {
 }
 
 size_t eventqueue_npjobs(EventQueue *evqueue) {
-    return evqueue->callbackqueue->size;
+    if (evqueue->backend == EVQ_DEQUE)
+        return evqueue->callbackqueue->size;
+    size_t head = atomic_load_explicit(&evqueue->ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&evqueue->ring->tail, memory_order_relaxed);
+    // consumers of EVQ_MPMC may move head on in between
+    return tail > head ? tail - head : 0;
 }
 
 int eventqueue_emplace(EventQueue *evqueue, EventCallback func, void *arg) {
+    if (evqueue->backend == EVQ_SPSC)
+        return spsc_push(evqueue->ring, func, arg);
+    if (evqueue->backend == EVQ_MPMC)
+        return mpmc_push(evqueue->ring, func, arg);
+
     QueuedJob *newjob = NEW(QueuedJob);
     if (newjob == NULL)
         return 1;
     newjob->func = func;
     newjob->arg = arg;
     SHOULD_LOCK(&evqueue->callbackqueue_mtx);
-    deque_push_left(evqueue->callbackqueue, newjob);
+    int res = deque_push_left(evqueue->callbackqueue, newjob);
     SHOULD_UNLOCK(&evqueue->callbackqueue_mtx);
-    return 0;
+    if (res != 0)
+        DELETE(newjob);
+    return res;
 }
 
 int eventqueue_emplace_stop(EventQueue *evqueue) {
+    if (evqueue->backend == EVQ_SPSC)
+        return spsc_push(evqueue->ring, NULL, NULL);
+    if (evqueue->backend == EVQ_MPMC)
+        return mpmc_push(evqueue->ring, NULL, NULL);
+
     SHOULD_LOCK(&evqueue->callbackqueue_mtx);
-    deque_push_left(evqueue->callbackqueue, &queued_stop_sig);
+    int res = deque_push_left(evqueue->callbackqueue, &queued_stop_sig);
     SHOULD_UNLOCK(&evqueue->callbackqueue_mtx);
-    return 0;
+    return res;
 }
 
-void eventqueue_this_thread_run(EventQueue *evqueue) {
-    if (evqueue->state == EVQ_RUNNING)
-        return;
-    evqueue->state = EVQ_RUNNING;
+// takes up to max jobs off the queue into jobs. a stop signal is returned as a job
+// without func; only EVQ_MPMC may return jobs after it
+static size_t take_jobs(EventQueue *evqueue, QueuedJob *jobs, size_t max) {
+    if (evqueue->backend == EVQ_SPSC)
+        return spsc_pop(evqueue->ring, jobs, max);
+    if (evqueue->backend == EVQ_MPMC)
+        return mpmc_pop(evqueue->ring, jobs, max);
 
-    for (;;) {
-        SHOULD_LOCK(&evqueue->callbackqueue_mtx);
-        if (deque_isempty(evqueue->callbackqueue)) {
-            SHOULD_UNLOCK(&evqueue->callbackqueue_mtx);
-            break;
-        }
+    // the deque: push job to left, get job from right
+    size_t n = 0;
+    SHOULD_LOCK(&evqueue->callbackqueue_mtx);
+    while (n < max && !deque_isempty(evqueue->callbackqueue)) {
         QueuedJob *job = (QueuedJob *)deque_pop_right(evqueue->callbackqueue);
-        SHOULD_UNLOCK(&evqueue->callbackqueue_mtx);
-        if (job == &queued_stop_sig)
+        if (job == &queued_stop_sig) {
+            jobs[n].func = NULL;
+            jobs[n++].arg = NULL;
             break;
-        EventCallback func = job->func;
-        void *arg = job->arg;
+        }
+        jobs[n++] = *job;
         DELETE(job);
-        // run func
-        func(evqueue, arg);
     }
+    SHOULD_UNLOCK(&evqueue->callbackqueue_mtx);
+    return n;
+}
+
+// runs up to max jobs; *stopped tells whether a stop signal was reached
+static size_t run_jobs(EventQueue *evqueue, size_t max, bool *stopped) {
+    QueuedJob jobs[RUN_BATCH];
+    size_t done = 0;
+    *stopped = false;
+    while (done < max && !*stopped) {
+        size_t n = take_jobs(evqueue, jobs, max - done < RUN_BATCH ? max - done : RUN_BATCH);
+        if (n == 0)
+            break;
+        for (size_t i = 0; i < n; ++i) {
+            if (jobs[i].func == NULL) {
+                *stopped = true;
+                continue;
+            }
+            // run func
+            jobs[i].func(evqueue, jobs[i].arg);
+            ++done;
+        }
+    }
+    return done;
+}
+
+size_t eventqueue_run_batch(EventQueue *evqueue, size_t max) {
+    bool stopped;
+    return run_jobs(evqueue, max, &stopped);
+}
+
+// counts the threads running an EVQ_MPMC queue, which is running while any is
+static void mpmc_enter(EventQueue *evqueue, int delta) {
+    struct EvqRing *ring = evqueue->ring;
+    while (atomic_flag_test_and_set_explicit(&ring->state_lock, memory_order_acquire))
+        ;
+    ring->runners += delta;
+    evqueue->state = ring->runners > 0 ? EVQ_RUNNING : EVQ_STOPPED;
+    atomic_flag_clear_explicit(&ring->state_lock, memory_order_release);
+}
+
+void eventqueue_this_thread_run(EventQueue *evqueue) {
+    bool stopped;
+    if (evqueue->backend == EVQ_MPMC) {
+        mpmc_enter(evqueue, 1);
+        run_jobs(evqueue, (size_t)-1, &stopped);
+        mpmc_enter(evqueue, -1);
+        return;
+    }
+
+    // test and set in one step, so that two threads never both take the jobs of a
+    // queue that allows one consumer
+    if (__atomic_exchange_n(&evqueue->state, EVQ_RUNNING, __ATOMIC_ACQUIRE) == EVQ_RUNNING)
+        return;
+
+    run_jobs(evqueue, (size_t)-1, &stopped);
 
     // queue is empty or signaled, stop
-    evqueue->state = EVQ_STOPPED;
+    __atomic_store_n(&evqueue->state, EVQ_STOPPED, __ATOMIC_RELEASE);
 }
@@ -18,6 +18,16 @@ extern "C" {
 struct Deque;
 typedef struct Deque Deque;
 
+// ring of jobs of the lock-free backends, internal
+struct EvqRing;
+
+// where the pending jobs are stored
+typedef enum EventQueueBackend {
+    EVQ_DEQUE, // unbounded deque, wrapped by a mutex if EVQ_USE_THREADSAFE is defined
+    EVQ_SPSC,  // bounded lock-free ring for one producer thread and one consumer thread
+    EVQ_MPMC   // bounded lock-free ring for any number of producer and consumer threads
+} EventQueueBackend;
+
 typedef enum EventQueueState {
     EVQ_STOPPED,
     EVQ_RUNNING
@@ -27,7 +37,9 @@ typedef enum EventQueueState {
 // behaviour is undefined if these fields are written
 typedef struct EventQueue {
     EventQueueState state;
-    Deque *callbackqueue;
+    EventQueueBackend backend;
+    Deque *callbackqueue;  // jobs of EVQ_DEQUE, else NULL
+    struct EvqRing *ring;  // jobs of the other backends, else NULL
 #ifdef EVQ_USE_THREADSAFE
     pthread_mutex_t callbackqueue_mtx;
 #endif
@@ -39,6 +51,22 @@ typedef void (*EventCallback)(EventQueue *evqueue, void *arg);
 // creates a new event queue in stopped state
 EventQueue *eventqueue_create();
 
+// creates a new event queue in stopped state, whose jobs are kept in a lock-free
+// ring of capacity slots, rounded up to a power of two. emplacing takes no lock
+// and allocates nothing, but fails when the ring is full.
+// only one thread may emplace, and only one may run the queue at a time; a
+// callback that emplaces into its own queue counts as a second producer unless
+// the queue is run by the producer thread
+// NULL is returned if this fails or the ring would not fit in memory
+EventQueue *eventqueue_create_spsc(size_t capacity);
+
+// like eventqueue_create_spsc(), but any number of threads may emplace, and any
+// number may run the queue at once. every slot has a sequence number that tells
+// whether it is free or filled in its current round, so producers only contend on
+// one atomic counter and consumers on another
+// NULL is returned if this fails
+EventQueue *eventqueue_create_mpmc(size_t capacity);
+
 // frees the resources occupied by the event queue
 // if it contains any heap userdata (void *args) unused, they are NOT freed
 // the queue has to be stopped, otherwise behaviour is undefined
@@ -55,15 +83,28 @@ size_t eventqueue_npjobs(EventQueue *evqueue);
 int eventqueue_emplace(EventQueue *evqueue, EventCallback func, void *arg);
 
 // add a stop signal to the back of the calling queue; the queue stops executing
-// when it reaches this signal and sets its state to stopped
+// when it reaches this signal and sets its state to stopped.
+// a runner of an EVQ_MPMC queue claims up to 32 jobs at once, and still runs the
+// jobs it claimed together with the signal, even those emplaced after it; it stops
+// only after them. the jobs left in the queue wait for the next run
 int eventqueue_emplace_stop(EventQueue *evqueue);
 
 // starts the queue and run the functions inside until it is exhausted or stopped
 // blocks this thread. has no effect if the queue is already running
-// (so you can call this to ensure the loop is running after inserting a job)
-// AT MOST one thread shall be running this function
+// (so you can call this to ensure the loop is running after inserting a job);
+// the check is atomic, so of several threads calling it at once only one runs the
+// queue. EVQ_MPMC queues are the exception: any number of threads may run them
+// together; the queue is running while any of them is, and a stop signal stops
+// only the thread that takes it
 void eventqueue_this_thread_run(EventQueue *evqueue);
 
+// runs up to max pending jobs on this thread without starting the queue, and
+// returns the number of them. jobs are taken off the queue several at a time, with
+// one lock or one atomic update for each group of them. a stop signal ends it
+// early and is consumed, without changing the state; jobs of EVQ_MPMC queues that
+// were taken together with it are still run
+size_t eventqueue_run_batch(EventQueue *evqueue, size_t max);
+
 #ifdef __cplusplus
 }
 #endif
@@ -5,6 +5,7 @@
 #include <err.h>
 #include <errno.h>
 #include <pthread.h>
+#include <semaphore.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <time.h>
@@ -18,7 +19,6 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-#define EVQ_USE_THREADSAFE
 #include "eventqueue.h"
 
 #define ERRSTR strerror(errno)
@@ -29,11 +29,15 @@
 
 
 // one main thread for delegating work to each MAX_WORKERS work thread.
-// each worker has its own function queue to query jobs
+// each worker has its own function queue to query jobs. the main thread is the
+// only producer and the worker the only consumer, so the queues are lock-free
+// single-producer single-consumer rings. workers live as long as the server and
+// sleep on their semaphore while their queue is empty
 // except the main thread, each worker only accesses to one item of the array
 static struct ThreadEquipment {
     int id;
     EventQueue *cbqueue;
+    sem_t jobs;            // posted once for every emplaced job
     pthread_t thread;
 } thread_equipments[MAX_WORKERS];
 
@@ -45,8 +49,15 @@ struct ThreadConnArg {
     socklen_t client_len;
 };
 
-static void *wrap_evqueue_start(void *arg) {
-    eventqueue_this_thread_run((EventQueue *)arg);
+static void *worker_run(void *arg) {
+    struct ThreadEquipment *eqp = (struct ThreadEquipment *)arg;
+    for (;;) {
+        // interrupted by a signal
+        if (sem_wait(&eqp->jobs) != 0)
+            continue;
+        // runs every job emplaced so far, so the next waits might find it empty
+        eventqueue_this_thread_run(eqp->cbqueue);
+    }
     return NULL;
 }
 
@@ -157,8 +168,13 @@ int main(int argc, char **argv) {
     // init some fields
     for (size_t i = 0; i < MAX_WORKERS; ++i) {
         thread_equipments[i].id = i;
-        if ((thread_equipments[i].cbqueue = eventqueue_create()) == NULL)
+        if ((thread_equipments[i].cbqueue = eventqueue_create_spsc(LISTENQ)) == NULL)
             errx(1, "cannot create evqueue");
+        if (sem_init(&thread_equipments[i].jobs, 0, 0) != 0)
+            err(1, "cannot create semaphore");
+        if ((errno = pthread_create(&thread_equipments[i].thread, NULL, worker_run, (void *)&thread_equipments[i])) != 0)
+            err(1, "cannot create thread");
+        pthread_detach(thread_equipments[i].thread);
     }
 
     int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
@@ -180,23 +196,15 @@ int main(int argc, char **argv) {
     printf("listening on port %d!\n", port);
 
     for (;;) {
-        int free_id = -1;
-        int should_rerun_thread = false;
-        // find a queue that is not running
+        // find the worker with the smallest load
+        // since the workers run meanwhile, this might not be most accurate
+        int free_id = 0;
+        size_t currmin = (size_t)-1;
         for (size_t i = 0; i < MAX_WORKERS; ++i) {
-            if (thread_equipments[i].cbqueue->state == EVQ_STOPPED) {
+            size_t npjobs = eventqueue_npjobs(thread_equipments[i].cbqueue);
+            if (npjobs < currmin) {
                 free_id = i;
-                should_rerun_thread = true;
-                break;
-            }
-        }
-        // if all threads are running, find the one with the smallest load
-        // since there are multiple threads, this might not be most accurate
-        if (!should_rerun_thread) {
-            size_t currmin = (size_t)-1;
-            for (size_t i = 0; i < MAX_WORKERS; ++i) {
-                if (eventqueue_npjobs(thread_equipments[i].cbqueue) < currmin)
-                    free_id = i;
+                currmin = npjobs;
             }
         }
 
@@ -215,16 +223,14 @@ int main(int argc, char **argv) {
         }
 
         // delegate work to that thread
-        eventqueue_emplace(cona->eqp->cbqueue, handle_request, (void *)cona);
-        // if that thread used to be running, at this point it might have stopped
-        if (cona->eqp->cbqueue->state == EVQ_STOPPED) {
-            // starting an event queue with no callbacks has no effect
-            if (pthread_create(&cona->eqp->thread, NULL, wrap_evqueue_start, (void *)cona->eqp->cbqueue) != 0) {
-                fprintf(stderr, "cannot create thread: %s", ERRSTR);
-                continue;
-            }
-            pthread_detach(cona->eqp->thread);
+        if (eventqueue_emplace(cona->eqp->cbqueue, handle_request, (void *)cona) != 0) {
+            fprintf(stderr, "tid %d: too many pending connections\n", cona->eqp->id);
+            close(cona->conn_fd);
+            free(cona);
+            continue;
         }
+        // wake the worker up; the job is in the ring before the post
+        sem_post(&cona->eqp->jobs);
     }
 
     // never happens
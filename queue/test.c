@@ -1,11 +1,195 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <signal.h>
 
+#include "deque.h"
 #include "eventqueue.h"
 
 #define CAST_LONG(X) (void *)(long)(X)
 
+// stops the tests at the first failed check
+#define CHECK(COND) do { \
+        if (!(COND)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #COND); \
+            exit(1); \
+        } \
+    } while (0)
+
+// pushes and pops random values at both ends against a plain array, so that the
+// ring wraps around and grows with its values in every position
+static void check_deque(void) {
+    enum { MAXLEN = 3000 };
+    static long ref[2 * MAXLEN]; // values from ref[lo] to ref[hi - 1], leftmost first
+    size_t lo = MAXLEN, hi = MAXLEN;
+    Deque *dq = deque_create();
+    CHECK(dq != NULL);
+    for (int i = 0; i < 200000; ++i) {
+        long v = (long)i + 1;
+        // leans to pushing for a while, then to popping
+        int push = rand() % 100 < (i / 20000 % 2 ? 30 : 70);
+        if (push && hi - lo < MAXLEN && rand() % 2) {
+            CHECK(deque_push_left(dq, CAST_LONG(v)) == 0);
+            ref[--lo] = v;
+        } else if (push && hi - lo < MAXLEN) {
+            CHECK(deque_push_right(dq, CAST_LONG(v)) == 0);
+            ref[hi++] = v;
+        } else if (rand() % 2) {
+            CHECK((long)deque_pop_left(dq) == (lo < hi ? ref[lo++] : 0));
+        } else {
+            CHECK((long)deque_pop_right(dq) == (lo < hi ? ref[--hi] : 0));
+        }
+        if (lo == hi) {
+            // recenter the reference
+            lo = hi = MAXLEN;
+        } else if (lo < MAXLEN / 2 || hi > MAXLEN * 3 / 2) {
+            size_t len = hi - lo;
+            memmove(&ref[MAXLEN - len / 2], &ref[lo], len * sizeof *ref);
+            lo = MAXLEN - len / 2;
+            hi = lo + len;
+        }
+        CHECK(dq->size == hi - lo);
+        CHECK(deque_isempty(dq) == (lo == hi));
+        CHECK((long)deque_left(dq) == (lo < hi ? ref[lo] : 0));
+        CHECK((long)deque_right(dq) == (lo < hi ? ref[hi - 1] : 0));
+        if (lo < hi) {
+            size_t j = (size_t)rand() % (hi - lo);
+            CHECK((long)deque_at(dq, j) == ref[lo + j]);
+        }
+        CHECK(deque_at(dq, hi - lo) == NULL);
+    }
+    deque_clear(dq);
+    CHECK(deque_isempty(dq) && deque_pop_left(dq) == NULL);
+    deque_free(dq);
+}
+
+// SPSC stress: one thread emplaces numbered jobs while two threads keep running
+// the queue. only one of them may run it at a time, so the jobs must run exactly
+// once and in order
+#define SPSC_JOBS 300000
+
+static long spsc_next = 1;     // number of the next job to run
+static atomic_bool spsc_done;
+
+static void spsc_job(EventQueue *evq, void *arg) {
+    (void)evq;
+    CHECK((long)arg == spsc_next);
+    ++spsc_next;
+}
+
+static void spsc_last(EventQueue *evq, void *arg) {
+    (void)evq;
+    (void)arg;
+    atomic_store(&spsc_done, true);
+}
+
+static void *spsc_producer(void *arg) {
+    EventQueue *evq = (EventQueue *)arg;
+    for (long i = 1; i <= SPSC_JOBS; ++i) {
+        while (eventqueue_emplace(evq, spsc_job, CAST_LONG(i)) != 0)
+            sched_yield();
+    }
+    while (eventqueue_emplace(evq, spsc_last, NULL) != 0)
+        sched_yield();
+    return NULL;
+}
+
+static void *spsc_consumer(void *arg) {
+    EventQueue *evq = (EventQueue *)arg;
+    while (!atomic_load(&spsc_done)) {
+        eventqueue_this_thread_run(evq);
+        sched_yield();
+    }
+    return NULL;
+}
+
+static void check_spsc(void) {
+    EventQueue *evq = eventqueue_create_spsc(256);
+    CHECK(evq != NULL);
+    pthread_t threads[3];
+    CHECK(pthread_create(&threads[0], NULL, spsc_producer, evq) == 0);
+    CHECK(pthread_create(&threads[1], NULL, spsc_consumer, evq) == 0);
+    CHECK(pthread_create(&threads[2], NULL, spsc_consumer, evq) == 0);
+    for (int i = 0; i < 3; ++i)
+        pthread_join(threads[i], NULL);
+    CHECK(spsc_next == SPSC_JOBS + 1);
+    CHECK(eventqueue_npjobs(evq) == 0 && evq->state == EVQ_STOPPED);
+    eventqueue_close(evq);
+    // oversized rings are refused
+    CHECK(eventqueue_create_spsc((size_t)-1) == NULL);
+}
+
+// MPMC stress: three threads emplace jobs while three others run the queue at once;
+// every job must run exactly once
+#define MPMC_THREADS 3
+#define MPMC_JOBS 100000
+
+static atomic_char mpmc_runs[MPMC_THREADS * MPMC_JOBS];
+static atomic_long mpmc_left;
+
+static void mpmc_job(EventQueue *evq, void *arg) {
+    (void)evq;
+    atomic_fetch_add(&mpmc_runs[(long)arg], 1);
+    atomic_fetch_sub(&mpmc_left, 1);
+}
+
+static void *mpmc_producer(void *arg) {
+    EventQueue *evq = (EventQueue *)arg;
+    static atomic_long nextid;
+    long first = atomic_fetch_add(&nextid, MPMC_JOBS);
+    for (long i = first; i < first + MPMC_JOBS; ++i) {
+        while (eventqueue_emplace(evq, mpmc_job, CAST_LONG(i)) != 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void *mpmc_consumer(void *arg) {
+    EventQueue *evq = (EventQueue *)arg;
+    while (atomic_load(&mpmc_left) > 0) {
+        eventqueue_this_thread_run(evq);
+        sched_yield();
+    }
+    return NULL;
+}
+
+static long counted;
+
+static void count_job(EventQueue *evq, void *arg) {
+    (void)evq;
+    (void)arg;
+    ++counted;
+}
+
+static void check_mpmc(void) {
+    EventQueue *evq = eventqueue_create_mpmc(512);
+    CHECK(evq != NULL);
+    atomic_store(&mpmc_left, MPMC_THREADS * MPMC_JOBS);
+    pthread_t threads[2 * MPMC_THREADS];
+    for (int i = 0; i < MPMC_THREADS; ++i) {
+        CHECK(pthread_create(&threads[i], NULL, mpmc_producer, evq) == 0);
+        CHECK(pthread_create(&threads[MPMC_THREADS + i], NULL, mpmc_consumer, evq) == 0);
+    }
+    for (int i = 0; i < 2 * MPMC_THREADS; ++i)
+        pthread_join(threads[i], NULL);
+    for (long i = 0; i < MPMC_THREADS * MPMC_JOBS; ++i)
+        CHECK(atomic_load(&mpmc_runs[i]) == 1);
+    CHECK(eventqueue_npjobs(evq) == 0 && evq->state == EVQ_STOPPED);
+
+    // a runner still runs the jobs it claimed together with a stop signal
+    for (int i = 0; i < 40; ++i)
+        CHECK((i == 5 ? eventqueue_emplace_stop(evq) : eventqueue_emplace(evq, count_job, NULL)) == 0);
+    eventqueue_this_thread_run(evq);
+    CHECK(counted == 31 && eventqueue_npjobs(evq) == 8);
+    eventqueue_this_thread_run(evq);
+    CHECK(counted == 39 && eventqueue_npjobs(evq) == 0);
+    eventqueue_close(evq);
+}
+
 static sig_atomic_t stop = 0;
 static void handle_interrupt(int sig) { (void)sig; stop = 1; }
 
@@ -28,6 +212,11 @@ static void counter2(EventQueue *evq, void *arg) {
 }
 
 int main() {
+    check_deque();
+    check_spsc();
+    check_mpmc();
+    printf("checks passed\n");
+
     signal(SIGINT, handle_interrupt);
     EventQueue *eq = eventqueue_create();
     eventqueue_emplace(eq, counter1, CAST_LONG(1));